@@ -4,11 +4,11 @@
 in vec3 fragColor;
 
 // output data
-out vec3 color;
+out vec4 color;
 
 void main()
 {
     // Output color = color specified in the vertex shader,
     // interpolated between all 3 surrounding vertices of the triangle
-    color = fragColor;
+    color = vec4(fragColor, 1);
 }
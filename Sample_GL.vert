@@ -1,22 +1,37 @@
 #version 330 core
 
-// input data : sent from main program
+// input data : sent from main program, interleaved in one buffer
+// 2D formats leave z at 0, formats without a color read constant white
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
 
-uniform mat4 MVP;
+// per-instance data : offset (xy) and scale (zw), and a color that
+// multiplies the vertex color. When the arrays are disabled these fall
+// back to the constant values set with glVertexAttrib (identity, white)
+layout (location = 2) in vec4 instanceTransform;
+layout (location = 3) in vec3 instanceColor;
+
+// shared by all programs : view-projection once per frame,
+// and the model matrix of the current draw (identity when instanced)
+layout (std140) uniform Camera {
+    mat4 VP;
+};
+layout (std140) uniform Object {
+    mat4 model;
+};
 
 // output data : used by fragment shader
 out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    vec3 position = vec3(vertexPosition.xy * instanceTransform.zw + instanceTransform.xy, vertexPosition.z);
+    vec4 v = vec4(position, 1); // Transform an homogeneous 4D vector
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
-    fragColor = vertexColor;
+    fragColor = vertexColor * instanceColor;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * model * v;
 }
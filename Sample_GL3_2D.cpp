@@ -3,521 +3,3018 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <map>
+#include <cstddef>
+#include <cstring>
+#include <cctype>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH 1
+#endif
+#include <cstdlib>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <cstdio>
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#endif
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 //#include <random>
 
-#define airResistance 0.985
-#define gravity 0.01
-#define NUMBER_OF_LEVELS 4
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include "simulation.h"
 using namespace std;
 
 double xpos, ypos, xposNew, yposNew;
+double aimX, aimY; //cursor in world space, as the simulation thread last received it
 int isKeyboard = 0; //Set to 1 to use keyboard
-int platformNumber = 4, obstacleNumber = 0;
-double obstacleData[3*15];
-double targetX = 1, targetY = 1;
-double platformData[15*4]; //= {-3,-3,6,0.5, 3,-2,6,0.5, 4,6,5,0.5, -7,1.5,2,0.5};
-//double obstacle[10*3];
-float canX = -14; float canY = -7; float canR = 0.4;
-int is_ball=0, level=1; //is_ball == 1 if there's a ball in the air
-char levelString[] = "1.txt";
-
-
-
-int random(int min, int max) //range : [min, max)
-{
-   static bool first = true;
-   if ( first )
-   {
-      srand(time(NULL)); //seeding for the first time only!
-      first = false;
-   }
-   return min + rand() % (max - min);
-}
+World Sim; //the game itself, stepped by the simulation thread
 
 
 struct VAO {
     GLuint VertexArrayID;
-    GLuint VertexBuffer;
-    GLuint ColorBuffer;
+    GLuint VertexBuffer; // interleaved, see the vertex formats below
+    GLuint IndexBuffer;    // 0 unless the mesh is indexed
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    int NumIndices;
+
+    int RefCount;   // live MeshRef handles, see MeshRef below
+    int NumBuffers; // GPU buffers owned by this VAO
+    long Bytes;     // bytes of GPU buffer storage owned by this VAO
 };
 typedef struct VAO VAO;
 
-struct GLMatrices {
-	glm::mat4 projection;
-	glm::mat4 model;
-	glm::mat4 view;
-	GLuint MatrixID;
-} Matrices;
+/* Keeps track of the geometry that is alive on the GPU */
+struct MeshRegistry {
+    int liveVAOs, liveBuffers;
+    long liveBytes;
+    int contextLost; // set once the GL context is gone; objects then die with it
+} Meshes;
+
+/* Shadow copy of the GL state that changes between draws. The cached* functions
+   below only reach GL when the value actually changes, and count both cases. */
+struct GLStateCache {
+    GLuint program;
+    GLuint vertexArray;
+    GLenum polygonMode;
+    GLfloat clearColor[4];
+    GLuint objectBuffer; GLintptr objectOffset; // range bound to the Object block
+    map<GLuint, unsigned> enabledAttribs;       // enabled arrays, per VAO
+
+    long issued, skipped;         // calls so far this frame
+    long lastIssued, lastSkipped; // totals of the previous frame
+} GLState;
+
+/* Forget everything, e.g. when a new context becomes current */
+void invalidateGLState ()
+{
+    GLState.program = 0;
+    GLState.vertexArray = 0;
+    GLState.polygonMode = GL_FILL; // GL defaults
+    GLState.clearColor[0] = GLState.clearColor[1] = GLState.clearColor[2] = GLState.clearColor[3] = 0;
+    GLState.objectBuffer = 0; GLState.objectOffset = -1;
+    GLState.enabledAttribs.clear();
+}
+
+void cachedUseProgram (GLuint program)
+{
+    if (GLState.program == program) { GLState.skipped++; return; }
+    GLState.issued++;
+    GLState.program = program;
+    glUseProgram(program);
+}
+
+void cachedBindVertexArray (GLuint vertexArray)
+{
+    if (GLState.vertexArray == vertexArray) { GLState.skipped++; return; }
+    GLState.issued++;
+    GLState.vertexArray = vertexArray;
+    glBindVertexArray(vertexArray);
+}
+
+void cachedPolygonMode (GLenum mode)
+{
+    if (GLState.polygonMode == mode) { GLState.skipped++; return; }
+    GLState.issued++;
+    GLState.polygonMode = mode;
+    glPolygonMode(GL_FRONT_AND_BACK, mode);
+}
+
+void cachedClearColor (GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+{
+    GLfloat *c = GLState.clearColor;
+    if (c[0] == r && c[1] == g && c[2] == b && c[3] == a) { GLState.skipped++; return; }
+    GLState.issued++;
+    c[0] = r; c[1] = g; c[2] = b; c[3] = a;
+    glClearColor(r, g, b, a);
+}
+
+/* Enable an attribute array of the currently bound VAO */
+void cachedEnableVertexAttribArray (GLuint index)
+{
+    unsigned &mask = GLState.enabledAttribs[GLState.vertexArray];
+    if (mask & (1u << index)) { GLState.skipped++; return; }
+    GLState.issued++;
+    mask |= 1u << index;
+    glEnableVertexAttribArray(index);
+}
+
+void cachedBindBufferRange (GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    if (GLState.objectBuffer == buffer && GLState.objectOffset == offset) { GLState.skipped++; return; }
+    GLState.issued++;
+    GLState.objectBuffer = buffer; GLState.objectOffset = offset;
+    glBindBufferRange(target, index, buffer, offset, size);
+}
+
+/* Called once per frame : keep last frame's counters for printGLStateStats */
+void resetGLStateCounters ()
+{
+    GLState.lastIssued = GLState.issued;
+    GLState.lastSkipped = GLState.skipped;
+    GLState.issued = GLState.skipped = 0;
+}
+
+void printGLStateStats ()
+{
+    cout << "GL state calls last frame: " << GLState.lastIssued << " issued, "
+         << GLState.lastSkipped << " skipped" << endl;
+}
+
+/* GPU profiler : GL_TIME_ELAPSED queries around named scopes of a frame.
+   Scopes do not nest, starting one ends the previous one. Each frame's queries
+   are read back PROFILE_FRAMES frames later and only if they are already
+   available, so the CPU never waits for them. */
+#define GPU_CLEAR 0
+#define GPU_STATIC 1  // baked level geometry
+#define GPU_DYNAMIC 2 // everything else in the render queue
+#define GPU_HUD 3
+#define GPU_SCOPES 4
+#define PROFILE_FRAMES 2   // frames in flight before readback
+#define PROFILE_HISTORY 120 // frames in the rolling stats
+
+const char* gpuScopeName[GPU_SCOPES] = { "clear", "static", "dynamic", "hud" };
+
+struct GPUProfiler {
+    int supported;
+    vector<GLuint> queries[PROFILE_FRAMES]; // grown on demand, reused every frame
+    vector<int> scopes[PROFILE_FRAMES];     // scope of each query issued in the frame
+    int used[PROFILE_FRAMES];               // queries issued in the frame
+    int slot;                               // frame being recorded
+    int active;                             // open scope, -1 if none
+    long frame;                             // frames recorded so far
+    long resolved, dropped;                 // frames read back, frames whose results were late
+    double history[PROFILE_HISTORY][GPU_SCOPES]; // ms per scope of the last resolved frames
+    ofstream csv;
+} Profiler;
+
+void initGPUProfiler (const char* csvPath)
+{
+    // Core since 3.3, so llvmpipe has it too
+    Profiler.supported = GLVersion.major > 3 || (GLVersion.major == 3 && GLVersion.minor >= 3) || GLAD_GL_ARB_timer_query;
+    Profiler.slot = 0;
+    Profiler.active = -1;
+    Profiler.frame = Profiler.resolved = Profiler.dropped = 0;
+    for (int i = 0; i < PROFILE_FRAMES; i++)
+      Profiler.used[i] = 0;
+    if (csvPath) {
+      Profiler.csv.open(csvPath);
+      Profiler.csv << "frame";
+      for (int s = 0; s < GPU_SCOPES; s++)
+        Profiler.csv << "," << gpuScopeName[s] << "_ms";
+      Profiler.csv << endl;
+    }
+}
+
+/* End the open scope and start 'scope' (-1 only ends) */
+void gpuScope (int scope)
+{
+    if (!Profiler.supported || scope == Profiler.active)
+      return;
+    if (Profiler.active >= 0)
+      glEndQuery(GL_TIME_ELAPSED);
+    Profiler.active = scope;
+    if (scope < 0)
+      return;
+
+    int f = Profiler.slot, i = Profiler.used[f]++;
+    if (i == (int) Profiler.queries[f].size()) {
+      GLuint query;
+      glGenQueries(1, &query);
+      Profiler.queries[f].push_back(query);
+      Profiler.scopes[f].push_back(scope);
+    }
+    Profiler.scopes[f][i] = scope;
+    glBeginQuery(GL_TIME_ELAPSED, Profiler.queries[f][i]);
+}
+
+/* Read back the slot's queries if they are all done, drop them otherwise */
+void resolveGPUFrame (int f, long frame)
+{
+    int n = Profiler.used[f];
+    Profiler.used[f] = 0;
+    if (n == 0)
+      return;
+
+    // Queries complete in order, so the last one tells for the whole frame
+    GLint available = 0;
+    glGetQueryObjectiv(Profiler.queries[f][n-1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      Profiler.dropped++;
+      return;
+    }
+
+    double* ms = Profiler.history[Profiler.resolved % PROFILE_HISTORY];
+    for (int s = 0; s < GPU_SCOPES; s++)
+      ms[s] = 0;
+    for (int i = 0; i < n; i++) {
+      GLuint64 ns = 0;
+      glGetQueryObjectui64v(Profiler.queries[f][i], GL_QUERY_RESULT, &ns);
+      ms[Profiler.scopes[f][i]] += ns/1e6;
+    }
+    Profiler.resolved++;
+
+    if (Profiler.csv.is_open()) {
+      Profiler.csv << frame;
+      for (int s = 0; s < GPU_SCOPES; s++)
+        Profiler.csv << "," << ms[s];
+      Profiler.csv << "\n";
+    }
+}
+
+/* Close the frame's last scope and move to the next slot, reading back its old queries */
+void endGPUFrame ()
+{
+    if (!Profiler.supported)
+      return;
+    gpuScope(-1);
+    Profiler.frame++;
+    Profiler.slot = (Profiler.slot + 1) % PROFILE_FRAMES;
+    resolveGPUFrame(Profiler.slot, Profiler.frame - PROFILE_FRAMES);
+}
+
+void printGPUProfile ()
+{
+    if (!Profiler.supported) {
+      cout << "GPU timer queries not supported" << endl;
+      return;
+    }
+    int frames = min(Profiler.resolved, (long) PROFILE_HISTORY);
+    cout << "GPU time over the last " << frames << " frames (ms avg / min / max), "
+         << Profiler.dropped << " frames dropped" << endl;
+    for (int s = 0; s < GPU_SCOPES; s++) {
+      double sum = 0, lo = 1e9, hi = 0;
+      for (int i = 0; i < frames; i++) {
+        double ms = Profiler.history[i][s];
+        sum += ms; lo = min(lo, ms); hi = max(hi, ms);
+      }
+      if (frames == 0) lo = 0;
+      cout << "  " << gpuScopeName[s] << ": " << (frames ? sum/frames : 0) << " / " << lo << " / " << hi << endl;
+    }
+}
 
 GLuint programID;
 
+/* Analytic circles : Sample_GL_circle.vert/.frag */
+struct CircleProgram {
+	GLuint ID;
+	GLint RingCountID, RingRadiusID, RingColorID;
+} CircleShader;
+
+/* HUD text : Sample_GL_text.vert/.frag */
+struct TextProgram {
+	GLuint ID;
+	GLint ScreenSizeID;
+} TextShader;
+
+/* Point sprite particles : Sample_GL_particle.vert/.frag */
+struct ParticleProgram {
+	GLuint ID;
+	GLint PointScaleID;
+} ParticleShader;
+
+#define MAX_RINGS 8 // keep in sync with Sample_GL_circle.frag
+
+// How circles are drawn : analytic quads, or triangle meshes
+#define CIRCLE_SDF 0
+#define CIRCLE_MESH 1
+#define CIRCLE_OUTLINE 2
+int circleMode = CIRCLE_SDF;
+
 /* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
-
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
-	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
+/* Program binary cache : linked programs are stored in SHADER_CACHE_DIR, named by
+   a hash of both sources and the driver's vendor, renderer and version strings,
+   so an edited shader or a driver update simply misses. */
+#define SHADER_CACHE_DIR "shadercache"
+
+/* Whole file in one read, false if it can't be opened */
+bool readShaderSource (const char* path, std::string &code)
+{
+	std::ifstream stream(path, std::ios::in | std::ios::binary);
+	if (!stream.is_open())
+		return false;
+	stream.seekg(0, std::ios::end);
+	code.resize(stream.tellg());
+	stream.seekg(0, std::ios::beg);
+	if (!code.empty())
+		stream.read(&code[0], code.size());
+	return true;
+}
+
+/* 64 bit FNV-1a, continuing from 'hash' */
+uint64_t hashBytes (const char* data, size_t n, uint64_t hash = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < n; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 1099511628211ULL;
 	}
+	return hash;
+}
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+bool programBinarySupported ()
+{
+	if (!GLAD_GL_ARB_get_program_binary && GLVersion.major*10 + GLVersion.minor < 41)
+		return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+std::string shaderCachePath (const std::string &vertexCode, const std::string &fragmentCode)
+{
+	uint64_t hash = hashBytes(vertexCode.c_str(), vertexCode.size() + 1);
+	hash = hashBytes(fragmentCode.c_str(), fragmentCode.size() + 1, hash);
+	const GLenum driver[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (int i = 0; i < 3; i++) {
+		const char* s = (const char*) glGetString(driver[i]);
+		if (s)
+			hash = hashBytes(s, strlen(s) + 1, hash);
 	}
+	char name[64];
+	snprintf(name, sizeof(name), SHADER_CACHE_DIR "/%016llx.bin", (unsigned long long) hash);
+	return name;
+}
 
-	GLint Result = GL_FALSE;
-	int InfoLogLength;
+/* Linked program from the cache, 0 on a miss or if the driver rejects the binary */
+GLuint loadProgramBinary (const std::string &path)
+{
+	std::string blob;
+	if (!readShaderSource(path.c_str(), blob) || blob.size() <= sizeof(GLenum))
+		return 0;
 
-	// Compile Vertex Shader
-	printf("Compiling shader : %s\n", vertex_file_path);
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-	glCompileShader(VertexShaderID);
-
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-	// Compile Fragment Shader
-	printf("Compiling shader : %s\n", fragment_file_path);
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
-
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
-
-	// Link the program
-	fprintf(stdout, "Linking program\n");
+	GLenum format;
+	memcpy(&format, &blob[0], sizeof(GLenum));
 	GLuint ProgramID = glCreateProgram();
-	glAttachShader(ProgramID, VertexShaderID);
-	glAttachShader(ProgramID, FragmentShaderID);
-	glLinkProgram(ProgramID);
+	glProgramBinary(ProgramID, format, &blob[sizeof(GLenum)], blob.size() - sizeof(GLenum));
 
-	// Check the program
+	GLint Result = GL_FALSE;
 	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-	fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
+	if (Result != GL_TRUE) {
+		glDeleteProgram(ProgramID);
+		return 0;
+	}
+	return ProgramID;
+}
+
+void storeProgramBinary (GLuint ProgramID, const std::string &path)
+{
+	GLint length = 0;
+	glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	std::vector<char> blob(sizeof(GLenum) + length);
+	GLenum format;
+	glGetProgramBinary(ProgramID, length, NULL, &format, &blob[sizeof(GLenum)]);
+	memcpy(&blob[0], &format, sizeof(GLenum));
+
+	mkdir(SHADER_CACHE_DIR, 0755);
+	std::ofstream stream(path.c_str(), std::ios::out | std::ios::binary);
+	if (stream.is_open())
+		stream.write(&blob[0], blob.size());
+}
+
+/* What went wrong while building a program, one entry per failed step */
+struct ShaderError {
+	std::string file;  // source file, or both for link errors
+	std::string stage; // "read", "compile" or "link"
+	std::string log;   // driver info log
+};
+
+struct ShaderReport {
+	std::vector<ShaderError> errors;
+	bool ok() const { return errors.empty(); }
+};
+
+void printShaderReport (const ShaderReport &report)
+{
+	for (size_t i = 0; i < report.errors.size(); i++) {
+		const ShaderError &e = report.errors[i];
+		fprintf(stderr, "%s error in %s:\n%s\n", e.stage.c_str(), e.file.c_str(), e.log.c_str());
+	}
+}
+
+/* Compile one stage, adding its info log to 'report' if it fails */
+GLuint compileShader (GLenum type, const char* path, const std::string &code, ShaderReport &report)
+{
+	printf("Compiling shader : %s\n", path);
+	GLuint ShaderID = glCreateShader(type);
+	char const * SourcePointer = code.c_str();
+	glShaderSource(ShaderID, 1, &SourcePointer , NULL);
+	glCompileShader(ShaderID);
+
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+	glGetShaderiv(ShaderID, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if (Result != GL_TRUE) {
+		std::vector<char> ShaderErrorMessage( max(InfoLogLength, int(1)) );
+		glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+		ShaderError e = { path, "compile", &ShaderErrorMessage[0] };
+		report.errors.push_back(e);
+	}
+	return ShaderID;
+}
+
+/* Build a program from the two files, 0 if any step fails. Failures go to
+   'report' when given, and are printed otherwise. */
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path, ShaderReport* report = NULL) {
+
+	ShaderReport localReport;
+	ShaderReport &r = report ? *report : localReport;
+	r.errors.clear();
+
+	// Read the shader code from the files
+	std::string VertexShaderCode, FragmentShaderCode;
+	if (!readShaderSource(vertex_file_path, VertexShaderCode)) {
+		ShaderError e = { vertex_file_path, "read", "can't open file" };
+		r.errors.push_back(e);
+	}
+	if (!readShaderSource(fragment_file_path, FragmentShaderCode)) {
+		ShaderError e = { fragment_file_path, "read", "can't open file" };
+		r.errors.push_back(e);
+	}
+	if (!r.ok()) {
+		if (!report) printShaderReport(r);
+		return 0;
+	}
+
+	// A cache hit skips compiling and linking entirely
+	bool useCache = programBinarySupported();
+	std::string cachePath;
+	if (useCache) {
+		cachePath = shaderCachePath(VertexShaderCode, FragmentShaderCode);
+		GLuint ProgramID = loadProgramBinary(cachePath);
+		if (ProgramID) {
+			printf("Loaded cached program : %s + %s\n", vertex_file_path, fragment_file_path);
+			return ProgramID;
+		}
+	}
+
+	GLuint VertexShaderID = compileShader(GL_VERTEX_SHADER, vertex_file_path, VertexShaderCode, r);
+	GLuint FragmentShaderID = compileShader(GL_FRAGMENT_SHADER, fragment_file_path, FragmentShaderCode, r);
+
+	GLuint ProgramID = 0;
+	if (r.ok()) {
+		// Link the program
+		fprintf(stdout, "Linking program\n");
+		ProgramID = glCreateProgram();
+		glAttachShader(ProgramID, VertexShaderID);
+		glAttachShader(ProgramID, FragmentShaderID);
+		if (useCache)
+			glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(ProgramID);
+
+		// Check the program
+		GLint Result = GL_FALSE;
+		int InfoLogLength;
+		glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+		glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+		if (Result != GL_TRUE) {
+			std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
+			glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+			ShaderError e = { std::string(vertex_file_path) + " + " + fragment_file_path, "link", &ProgramErrorMessage[0] };
+			r.errors.push_back(e);
+			glDeleteProgram(ProgramID);
+			ProgramID = 0;
+		}
+		else if (useCache)
+			storeProgramBinary(ProgramID, cachePath);
+	}
 
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
 
+	if (!r.ok() && !report)
+		printShaderReport(r);
 	return ProgramID;
 }
 
+/* Shader hot reload : a thread watches the working directory with inotify and
+   flags edits of *.vert and *.frag. The render thread picks the flag up between
+   frames (shadersChanged) and rebuilds the programs itself. */
+struct ShaderWatcher {
+	std::thread thread;
+	std::atomic<int> changed, stop;
+} Watcher;
+
+bool isShaderFile (const char* name)
+{
+	const char* dot = strrchr(name, '.');
+	return dot && (strcmp(dot, ".vert") == 0 || strcmp(dot, ".frag") == 0);
+}
+
+#ifdef __linux__
+void watchShaders (int fd)
+{
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (!Watcher.stop) {
+		pollfd p = { fd, POLLIN, 0 };
+		if (poll(&p, 1, 100) <= 0) // wake up now and then to notice 'stop'
+			continue;
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		for (char* ptr = buffer; ptr < buffer + n; ) {
+			struct inotify_event* event = (struct inotify_event*) ptr;
+			if (event->len && isShaderFile(event->name))
+				Watcher.changed = 1;
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	close(fd);
+}
+#endif
+
+void startShaderWatcher (const char* directory)
+{
+#ifdef __linux__
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return;
+	// Editors either rewrite the file or rename a new one over it
+	if (inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(fd);
+		return;
+	}
+	Watcher.thread = std::thread(watchShaders, fd);
+#endif
+}
+
+void stopShaderWatcher ()
+{
+	Watcher.stop = 1;
+	if (Watcher.thread.joinable())
+		Watcher.thread.join();
+}
+
+/* True once after any number of shader edits */
+bool shadersChanged ()
+{
+	return Watcher.changed.exchange(0) != 0;
+}
+
+/* Frame capture : every frame is read into one of CAPTURE_PBOS pixel buffers
+   with an asynchronous glReadPixels. A buffer is mapped CAPTURE_PBOS-1 frames
+   later, once its fence says the copy is done, and handed to a worker thread
+   which writes either numbered PNG files or raw RGB24 to a file or pipe
+   (e.g. for ffmpeg -f rawvideo -pix_fmt rgb24). Frames are dropped, never
+   waited for, when the GPU or the writer falls behind. */
+#define CAPTURE_PBOS 3
+#define CAPTURE_QUEUE 4 // frames waiting for the writer
+
+struct CaptureFrame {
+    long number;
+    int width, height;
+    vector<unsigned char> pixels; // RGBA, bottom row first
+};
+
+struct FrameCapture {
+    int enabled, png;
+    string target;  // printf pattern of the PNG files, or the raw output ("-" for stdout)
+    string pattern; // target with its frame number conversion made %[0][width]ld
+    FILE* raw;
+    FILE* stdoutFile; // the real stdout once claimStdoutForCapture moved text away from it
+    int width, height;
+
+    GLuint Buffers[CAPTURE_PBOS];
+    long bytes;     // held by the pixel buffers
+    GLsync fence[CAPTURE_PBOS];
+    long frameOf[CAPTURE_PBOS];
+    int next;       // buffer the next frame is read into
+    long frame;     // frames seen so far
+    long written, dropped;
+
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<CaptureFrame> queue, spare; // spare frames keep their pixel storage
+    int stop;
+} Capture;
+
+uint32_t crc32Bytes (const unsigned char* data, size_t n, uint32_t crc)
+{
+    static uint32_t table[256];
+    if (!table[1])
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        table[i] = c;
+      }
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void putBE32 (vector<unsigned char> &out, uint32_t v)
+{
+    out.push_back(v >> 24); out.push_back(v >> 16); out.push_back(v >> 8); out.push_back(v);
+}
+
+void pngChunk (FILE* file, const char* type, const vector<unsigned char> &data)
+{
+    vector<unsigned char> chunk;
+    putBE32(chunk, data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    putBE32(chunk, crc32Bytes(&chunk[4], chunk.size() - 4, 0));
+    fwrite(&chunk[0], 1, chunk.size(), file);
+}
+
+/* RGB PNG with stored (uncompressed) deflate blocks: no zlib, and the writer
+   stays far ahead of 60 fps */
+void writePNG (const char* path, int width, int height, const vector<unsigned char> &rgba)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+      return;
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+    fwrite(signature, 1, 8, file);
+
+    vector<unsigned char> header;
+    putBE32(header, width); putBE32(header, height);
+    header.push_back(8); header.push_back(2); // 8 bit RGB
+    header.push_back(0); header.push_back(0); header.push_back(0);
+    pngChunk(file, "IHDR", header);
+
+    // Scanlines top row first, each with filter byte 0
+    vector<unsigned char> lines;
+    lines.reserve(height*(1 + 3*width));
+    for (int y = height-1; y >= 0; y--) {
+      lines.push_back(0);
+      const unsigned char* p = &rgba[4*width*y];
+      for (int x = 0; x < width; x++, p += 4)
+        lines.insert(lines.end(), p, p + 3);
+    }
+
+    vector<unsigned char> z;
+    z.reserve(lines.size() + lines.size()/65535*5 + 16);
+    z.push_back(0x78); z.push_back(0x01);
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+      a = (a + lines[i]) % 65521; b = (b + a) % 65521;
+    }
+    for (size_t pos = 0; pos < lines.size() || pos == 0; ) {
+      size_t n = min(lines.size() - pos, (size_t) 65535);
+      z.push_back(pos + n == lines.size());
+      z.push_back(n & 0xff); z.push_back(n >> 8);
+      z.push_back(~n & 0xff); z.push_back((~n >> 8) & 0xff);
+      z.insert(z.end(), lines.begin() + pos, lines.begin() + pos + n);
+      pos += n;
+      if (n == 0) break;
+    }
+    putBE32(z, (b << 16) | a);
+    pngChunk(file, "IDAT", z);
+    pngChunk(file, "IEND", vector<unsigned char>());
+    fclose(file);
+}
+
+/* 'target' as a pattern for snprintf with one long argument, or "" unless it has
+   exactly one conversion, %d with an optional 0 flag, width and l (%% aside) */
+string capturePattern (const string &target)
+{
+    string pattern;
+    int conversions = 0;
+    for (size_t i = 0; i < target.size(); i++) {
+      pattern += target[i];
+      if (target[i] != '%')
+        continue;
+      if (++i < target.size() && target[i] == '%') {
+        pattern += '%';
+        continue;
+      }
+      if (i < target.size() && target[i] == '0')
+        pattern += target[i++];
+      while (i < target.size() && isdigit((unsigned char) target[i]))
+        pattern += target[i++];
+      if (i < target.size() && target[i] == 'l')
+        i++;
+      if (i >= target.size() || target[i] != 'd' || ++conversions > 1)
+        return "";
+      pattern += "ld";
+    }
+    return conversions == 1 ? pattern : "";
+}
+
+void writeCaptureFrame (CaptureFrame &f)
+{
+    if (Capture.png) {
+      char path[1024];
+      snprintf(path, sizeof(path), Capture.pattern.c_str(), f.number);
+      writePNG(path, f.width, f.height, f.pixels);
+      return;
+    }
+    vector<unsigned char> line(3*f.width);
+    for (int y = f.height-1; y >= 0; y--) {
+      const unsigned char* p = &f.pixels[4*f.width*y];
+      for (int x = 0; x < f.width; x++, p += 4) {
+        line[3*x] = p[0]; line[3*x+1] = p[1]; line[3*x+2] = p[2];
+      }
+      fwrite(&line[0], 1, line.size(), Capture.raw);
+    }
+}
+
+void captureWorker ()
+{
+    std::unique_lock<std::mutex> guard(Capture.lock);
+    while (true) {
+      while (Capture.queue.empty() && !Capture.stop)
+        Capture.wake.wait(guard);
+      if (Capture.queue.empty())
+        break;
+      CaptureFrame f;
+      f.number = Capture.queue.front().number;
+      f.width = Capture.queue.front().width;
+      f.height = Capture.queue.front().height;
+      f.pixels.swap(Capture.queue.front().pixels);
+      Capture.queue.pop_front();
+
+      guard.unlock();
+      writeCaptureFrame(f);
+      guard.lock();
+      Capture.written++;
+      Capture.spare.push_back(CaptureFrame());
+      Capture.spare.back().pixels.swap(f.pixels);
+    }
+}
+
+/* "--capture -" : the frames keep the real stdout, and everything else printed
+   to it, ours or the GL driver's, goes to stderr. Must run before any output. */
+void claimStdoutForCapture ()
+{
+#ifdef __linux__
+    fflush(stdout);
+    Capture.stdoutFile = fdopen(dup(STDOUT_FILENO), "wb");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+#else
+    cerr << "capture: \"-\" is only supported on Linux, give a file or pipe" << endl;
+    exit(EXIT_FAILURE);
+#endif
+}
+
+/* Start capturing frames of width x height into 'target' */
+void initCapture (const string &target, int width, int height)
+{
+    Capture.target = target;
+    Capture.png = target.find(".png") != string::npos;
+    Capture.raw = NULL;
+    if (Capture.png) {
+      Capture.pattern = capturePattern(target);
+      if (Capture.pattern.empty()) {
+        cerr << "capture: " << target << " needs exactly one frame number conversion, like %05d" << endl;
+        return;
+      }
+    }
+    else {
+      Capture.raw = target == "-" ? Capture.stdoutFile : fopen(target.c_str(), "wb");
+      if (!Capture.raw) {
+        cerr << "capture: can't open " << target << endl;
+        return;
+      }
+    }
+    Capture.width = width; Capture.height = height;
+
+    glGenBuffers(CAPTURE_PBOS, Capture.Buffers);
+    for (int i = 0; i < CAPTURE_PBOS; i++) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture.Buffers[i]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, 4*width*height, NULL, GL_STREAM_READ);
+      Capture.fence[i] = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    Capture.bytes = (long) CAPTURE_PBOS*4*width*height;
+
+    Capture.next = 0;
+    Capture.frame = Capture.written = Capture.dropped = 0;
+    Capture.stop = 0;
+    Capture.worker = std::thread(captureWorker);
+    Capture.enabled = 1;
+}
+
+/* Hand the buffer's pixels to the writer; 'wait' blocks on the GPU, only used when stopping */
+void collectCapture (int i, bool wait)
+{
+    if (!Capture.fence[i])
+      return;
+    GLenum status = glClientWaitSync(Capture.fence[i], GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000 : 0);
+    if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED) {
+      Capture.dropped++; // its buffer is about to be reused
+      glDeleteSync(Capture.fence[i]);
+      Capture.fence[i] = 0;
+      return;
+    }
+    glDeleteSync(Capture.fence[i]);
+    Capture.fence[i] = 0;
+
+    CaptureFrame f;
+    {
+      std::lock_guard<std::mutex> guard(Capture.lock);
+      if (Capture.queue.size() >= CAPTURE_QUEUE) {
+        Capture.dropped++;
+        return;
+      }
+      if (!Capture.spare.empty()) {
+        f.pixels.swap(Capture.spare.front().pixels);
+        Capture.spare.pop_front();
+      }
+    }
+    f.number = Capture.frameOf[i];
+    f.width = Capture.width; f.height = Capture.height;
+    f.pixels.resize(4*Capture.width*Capture.height);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture.Buffers[i]);
+    void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, f.pixels.size(), GL_MAP_READ_BIT);
+    if (pixels) {
+      memcpy(&f.pixels[0], pixels, f.pixels.size());
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (!pixels)
+      return;
+
+    std::lock_guard<std::mutex> guard(Capture.lock);
+    Capture.queue.push_back(CaptureFrame());
+    Capture.queue.back().number = f.number;
+    Capture.queue.back().width = f.width;
+    Capture.queue.back().height = f.height;
+    Capture.queue.back().pixels.swap(f.pixels);
+    Capture.wake.notify_one();
+}
+
+/* Queue the readback of the frame just drawn, before swapping buffers */
+void captureFrame ()
+{
+    if (!Capture.enabled)
+      return;
+    int i = Capture.next;
+    collectCapture(i, false); // the oldest readback, issued CAPTURE_PBOS frames ago
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture.Buffers[i]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, Capture.width, Capture.height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    Capture.fence[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    Capture.frameOf[i] = Capture.frame++;
+    Capture.next = (i + 1) % CAPTURE_PBOS;
+}
+
+void printCaptureStats ()
+{
+    if (!Capture.enabled)
+      return;
+    std::lock_guard<std::mutex> guard(Capture.lock); // the writer counts frames
+    cout << "Capture: " << Capture.width << "x" << Capture.height << ", "
+         << CAPTURE_PBOS << " pixel buffers, " << Capture.bytes << " bytes, "
+         << Capture.written << " frames written, " << Capture.dropped << " dropped" << endl;
+}
+
+/* Collect the readbacks still in flight and let the writer finish */
+void stopCapture ()
+{
+    if (!Capture.enabled)
+      return;
+    Capture.enabled = 0;
+    for (int k = 0; k < CAPTURE_PBOS; k++)
+      collectCapture((Capture.next + k) % CAPTURE_PBOS, true);
+    {
+      std::lock_guard<std::mutex> guard(Capture.lock);
+      Capture.stop = 1;
+      Capture.wake.notify_one();
+    }
+    Capture.worker.join();
+    if (Capture.raw)
+      fclose(Capture.raw);
+    cerr << "capture: " << Capture.written << " frames written, " << Capture.dropped << " dropped" << endl;
+}
+
+/* PNG frames follow the framebuffer's size: readbacks not done yet are
+   dropped, never waited for, and the pixel buffers reallocated. A raw stream
+   cannot change frame size, it keeps reading its first size from the bottom
+   left corner and stops once the framebuffer is too small for it. */
+void resizeCapture (int width, int height)
+{
+    if (!Capture.enabled || (width == Capture.width && height == Capture.height))
+      return;
+    if (!Capture.png) {
+      if (width < Capture.width || height < Capture.height) {
+        cerr << "capture: the framebuffer shrank below the raw stream's "
+             << Capture.width << "x" << Capture.height << ", stopping" << endl;
+        stopCapture();
+      }
+      return;
+    }
+    for (int k = 0; k < CAPTURE_PBOS; k++)
+      collectCapture((Capture.next + k) % CAPTURE_PBOS, false);
+    for (int i = 0; i < CAPTURE_PBOS; i++) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture.Buffers[i]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, 4*width*height, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    Capture.width = width; Capture.height = height;
+    Capture.bytes = (long) CAPTURE_PBOS*4*width*height;
+}
+
 static void error_callback(int error, const char* description)
 {
     fprintf(stderr, "Error: %s\n", description);
 }
 
+/* Simulation thread : steps the world every SIM_STEP seconds and publishes a
+   Snapshot of it for the render thread. Input events reach it through a single
+   producer, single consumer queue that only the main thread writes; the cursor
+   is continuous state, published as a latest value instead, so that however
+   fast frames come it never fills the queue and crowds out a click. */
+#define SIM_STEP WORLD_TICK // seconds, one step() of the world
+#define SIM_MAX_STEPS 10 // per wake up; time beyond that is dropped rather than caught up
+
+#define INPUT_FIRE 0
+#define INPUT_CIRCLE_MODE 1 // SDF -> mesh -> outline
+#define INPUT_VIEW 2        // x : on-screen pixels per world unit, for circle LOD
+
+struct InputEvent {
+    int type;
+    double x, y;
+};
+
+#define INPUT_CAPACITY 256 // power of two
+
+struct InputQueue {
+    InputEvent events[INPUT_CAPACITY];
+    std::atomic<unsigned> head; // next slot to write, main thread only
+    std::atomic<unsigned> tail; // next slot to read, simulation thread only
+    long dropped;               // pushed while full
+} Input;
+
+/* Main thread; an event that finds the queue full is dropped */
+bool pushInput (int type, double x = 0, double y = 0)
+{
+    unsigned head = Input.head.load(std::memory_order_relaxed);
+    if (head - Input.tail.load(std::memory_order_acquire) == INPUT_CAPACITY) {
+      Input.dropped++;
+      return false;
+    }
+    InputEvent &e = Input.events[head & (INPUT_CAPACITY-1)];
+    e.type = type; e.x = x; e.y = y;
+    Input.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+struct AimPoint {
+    float x, y; // cursor in world space
+};
+
+std::atomic<AimPoint> Aim;
+
+/* Main thread, once per frame */
+void publishAim (double x, double y)
+{
+    AimPoint p = { (float) x, (float) y };
+    Aim.store(p, std::memory_order_relaxed);
+}
+
+/* Simulation thread */
+bool popInput (InputEvent &e)
+{
+    unsigned tail = Input.tail.load(std::memory_order_relaxed);
+    if (tail == Input.head.load(std::memory_order_acquire))
+      return false;
+    e = Input.events[tail & (INPUT_CAPACITY-1)];
+    Input.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+struct SimulationThread {
+    std::thread thread;
+    std::atomic<int> stop;
+    std::atomic<long> steps;   // SIM_STEPs run
+    std::atomic<long> dropped; // SIM_STEPs skipped by the SIM_MAX_STEPS clamp
+} SimThread;
+
+void stopSimulation ()
+{
+    if (!SimThread.thread.joinable())
+      return;
+    SimThread.stop = 1;
+    SimThread.thread.join();
+}
+
+/* Frame pacing : log-linear ("HDR") histograms of the main loop's CPU time,
+   the interval between swaps and the simulation's time per wake up. Values
+   below 2^HISTOGRAM_SUB_BITS microseconds are exact, larger ones keep
+   HISTOGRAM_SUB_BITS-1 bits, about 3% precision, up to a minute. */
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_MAX_SHIFT 21 // values up to 2^(HISTOGRAM_MAX_SHIFT+HISTOGRAM_SUB_BITS) us
+#define HISTOGRAM_HALF (1 << (HISTOGRAM_SUB_BITS-1))
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT + 2)*HISTOGRAM_HALF)
+#define PACING_STUTTER 1.5 // swap intervals this many times the running average are stutters
+
+struct FrameHistogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    long total;
+    double max; // ms
+};
+
+/* Bucket of a value in microseconds: shift s holds [HALF, 2*HALF) << s */
+int histogramBucket (uint64_t us)
+{
+    const uint64_t top = ((uint64_t) 2*HISTOGRAM_HALF << HISTOGRAM_MAX_SHIFT) - 1;
+    if (us > top)
+      us = top;
+    if (us < 2*HISTOGRAM_HALF)
+      return us;
+    int shift = 63 - __builtin_clzll(us) - (HISTOGRAM_SUB_BITS-1);
+    return shift*HISTOGRAM_HALF + (us >> shift);
+}
+
+/* Smallest value, in microseconds, of the bucket after b */
+uint64_t histogramBucketEnd (int b)
+{
+    b++;
+    if (b < 2*HISTOGRAM_HALF)
+      return b;
+    int shift = b/HISTOGRAM_HALF - 1;
+    return (uint64_t) (b - shift*HISTOGRAM_HALF) << shift;
+}
+
+void recordTime (FrameHistogram &h, double ms)
+{
+    h.counts[histogramBucket((uint64_t) (ms*1000))]++;
+    h.total++;
+    h.max = max(h.max, ms);
+}
+
+/* Upper bound in ms of the fraction p of the recorded values */
+double histogramPercentile (const FrameHistogram &h, double p)
+{
+    uint64_t rank = (uint64_t) ceil(p*h.total), seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+      seen += h.counts[b];
+      if (seen >= rank && seen)
+        return min(histogramBucketEnd(b)/1000.0, h.max);
+    }
+    return h.max;
+}
+
+struct FramePacing {
+    FrameHistogram cpu;  // input, draw and capture of a frame, main thread
+    FrameHistogram swap; // between successive swaps, what the display actually got
+    FrameHistogram sim;  // one simulation wake up, written by its thread under simLock
+    std::mutex simLock;
+    long stutters;
+    double average;      // running average of the swap interval, ms
+    std::chrono::steady_clock::time_point lastSwap;
+} Pacing;
+
+/* After each swap; the first one only starts the clock */
+void recordSwap ()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (Pacing.lastSwap != std::chrono::steady_clock::time_point()) {
+      double ms = std::chrono::duration<double, std::milli>(now - Pacing.lastSwap).count();
+      recordTime(Pacing.swap, ms);
+      if (Pacing.average && ms > PACING_STUTTER*Pacing.average)
+        Pacing.stutters++;
+      Pacing.average = Pacing.average ? 0.95*Pacing.average + 0.05*ms : ms;
+    }
+    Pacing.lastSwap = now;
+}
+
+void printHistogram (const char* name, const FrameHistogram &h)
+{
+    char line[128];
+    snprintf(line, sizeof(line), "  %-5s %8ld %8.2f %8.2f %8.2f %8.2f", name, h.total,
+             histogramPercentile(h, 0.5), histogramPercentile(h, 0.95), histogramPercentile(h, 0.99), h.max);
+    cout << line << endl;
+}
+
+/* Key 't', and on exit */
+void printFramePacing ()
+{
+    cout << "Frame pacing (ms), " << Pacing.stutters << " stutters over "
+         << PACING_STUTTER << "x the average swap interval" << endl;
+    cout << "           count      p50      p95      p99      max" << endl;
+    printHistogram("cpu", Pacing.cpu);
+    printHistogram("swap", Pacing.swap);
+    std::lock_guard<std::mutex> lock(Pacing.simLock);
+    printHistogram("sim", Pacing.sim);
+    cout << "Simulation: " << SimThread.steps << " steps, " << SimThread.dropped
+         << " dropped by the " << SIM_MAX_STEPS << " steps per wake up clamp" << endl;
+    cout << "Input: " << Input.dropped << " events dropped on a full queue" << endl;
+}
+
 void quit(GLFWwindow *window)
 {
+    stopSimulation();
+    printFramePacing();
+    stopShaderWatcher();
+    stopCapture();
+    Meshes.contextLost = 1; // remaining meshes are freed along with the context
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
 
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
-{
-    struct VAO* vao = new struct VAO;
-    vao->PrimitiveMode = primitive_mode;
-    vao->NumVertices = numVertices;
-    vao->FillMode = fill_mode;
+/* Vertex formats : each one lists its interleaved attributes at compile time.
+   Attributes a format leaves out are read from the constant values set in
+   resetInstanceAttributes, so one shader handles every layout. */
+struct VertexAttrib {
+    GLuint index;        // shader location
+    GLint size;          // components
+    GLenum type;
+    GLboolean normalized;
+    size_t offset;       // byte offset inside the vertex
+};
 
-    // Create Vertex Array Object
-    // Should be done after CreateWindow and before any other GL calls
-    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+/* 2D position only (8 bytes) - color comes from the instance attribute */
+struct VertexP2 {
+    GLfloat x, y;
+
+    static const int NumAttribs = 1;
+    static const VertexAttrib* attribs(){
+      static const VertexAttrib a[] = {
+        { 0, 2, GL_FLOAT, GL_FALSE, offsetof(VertexP2, x) },
+      };
+      return a;
+    }
+};
+
+/* 2D position + RGBA8 color (12 bytes) */
+struct VertexP2C4 {
+    GLfloat x, y;
+    GLubyte r, g, b, a;
+
+    static const int NumAttribs = 2;
+    static const VertexAttrib* attribs(){
+      static const VertexAttrib a[] = {
+        { 0, 2, GL_FLOAT, GL_FALSE, offsetof(VertexP2C4, x) },
+        { 1, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(VertexP2C4, r) },
+      };
+      return a;
+    }
+};
+
+/* 2D position + RGBA8 color + point size (16 bytes) - particles */
+struct VertexP2C4S {
+    GLfloat x, y;
+    GLubyte r, g, b, a;
+    GLfloat size;
+
+    static const int NumAttribs = 3;
+    static const VertexAttrib* attribs(){
+      static const VertexAttrib a[] = {
+        { 0, 2, GL_FLOAT, GL_FALSE, offsetof(VertexP2C4S, x) },
+        { 1, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(VertexP2C4S, r) },
+        { 2, 1, GL_FLOAT, GL_FALSE, offsetof(VertexP2C4S, size) },
+      };
+      return a;
+    }
+};
+
+/* 2D position + texture coordinates + RGBA8 color (20 bytes) - HUD text */
+struct VertexP2T2C4 {
+    GLfloat x, y;
+    GLfloat u, v;
+    GLubyte r, g, b, a;
+
+    static const int NumAttribs = 3;
+    static const VertexAttrib* attribs(){
+      static const VertexAttrib a[] = {
+        { 0, 2, GL_FLOAT, GL_FALSE, offsetof(VertexP2T2C4, x) },
+        { 1, 2, GL_FLOAT, GL_FALSE, offsetof(VertexP2T2C4, u) },
+        { 2, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(VertexP2T2C4, r) },
+      };
+      return a;
+    }
+};
+
+/* 3D position + RGBA8 color (16 bytes) */
+struct VertexP3C4 {
+    GLfloat x, y, z;
+    GLubyte r, g, b, a;
+
+    static const int NumAttribs = 2;
+    static const VertexAttrib* attribs(){
+      static const VertexAttrib a[] = {
+        { 0, 3, GL_FLOAT, GL_FALSE, offsetof(VertexP3C4, x) },
+        { 1, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(VertexP3C4, r) },
+      };
+      return a;
+    }
+};
+
+/* Convert a [0, 1] color component to a normalized byte */
+GLubyte colorByte (float c)
+{
+    if (c < 0) c = 0;
+    if (c > 1) c = 1;
+    return (GLubyte) (c*255 + 0.5f);
+}
+
+/* Generate VAO, one interleaved VBO and return VAO handle */
+template <typename Vertex>
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const Vertex* vertices, GLenum fill_mode=GL_FILL)
+{
+    struct VAO* vao = new struct VAO;
+    vao->IndexBuffer = 0;
+    vao->NumIndices = 0;
+    vao->RefCount = 0;
+    vao->NumBuffers = 1;
+    vao->Bytes = numVertices*sizeof(Vertex);
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->FillMode = fill_mode;
+
+    // Create Vertex Array Object
+    // Should be done after CreateWindow and before any other GL calls
+    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - interleaved vertices
+
+    cachedBindVertexArray (vao->VertexArrayID); // Bind the VAO
+    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
+    glBufferData (GL_ARRAY_BUFFER, numVertices*sizeof(Vertex), vertices, GL_STATIC_DRAW); // Copy the vertices into VBO
+
+    // The VAO remembers the enabled attributes and their layout
+    const VertexAttrib* attribs = Vertex::attribs();
+    for (int i=0; i<Vertex::NumAttribs; i++) {
+      cachedEnableVertexAttribArray(attribs[i].index);
+      glVertexAttribPointer(attribs[i].index, attribs[i].size, attribs[i].type, attribs[i].normalized,
+                            sizeof(Vertex), (void*)attribs[i].offset);
+    }
+
+    return vao;
+}
+
+/* VAO without a buffer of its own, for vertices written every frame into a
+   shared streaming buffer; pointVertices tells it where they are */
+template <typename Vertex>
+struct VAO* createStreamObject (GLenum primitive_mode)
+{
+    struct VAO* vao = new struct VAO;
+    vao->VertexBuffer = vao->IndexBuffer = 0;
+    vao->NumVertices = vao->NumIndices = 0;
+    vao->RefCount = 0;
+    vao->NumBuffers = 0;
+    vao->Bytes = 0;
+    vao->PrimitiveMode = primitive_mode;
+    vao->FillMode = GL_FILL;
+
+    glGenVertexArrays(1, &(vao->VertexArrayID));
+    cachedBindVertexArray (vao->VertexArrayID);
+    const VertexAttrib* attribs = Vertex::attribs();
+    for (int i=0; i<Vertex::NumAttribs; i++)
+      cachedEnableVertexAttribArray(attribs[i].index);
+    return vao;
+}
+
+/* Read the VAO's vertices from 'buffer', starting 'base' bytes in */
+template <typename Vertex>
+void pointVertices (struct VAO* vao, GLuint buffer, size_t base)
+{
+    cachedBindVertexArray (vao->VertexArrayID);
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+    const VertexAttrib* attribs = Vertex::attribs();
+    for (int i=0; i<Vertex::NumAttribs; i++)
+      glVertexAttribPointer(attribs[i].index, attribs[i].size, attribs[i].type, attribs[i].normalized,
+                            sizeof(Vertex), (void*)(base + attribs[i].offset));
+}
+
+/* Generate VAO, VBOs and return VAO handle - indexed geometry */
+template <typename Vertex>
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const Vertex* vertices, int numIndices, const GLushort* indices, GLenum fill_mode=GL_FILL)
+{
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, vertices, fill_mode);
+    vao->NumIndices = numIndices;
+    vao->NumBuffers++;
+    vao->Bytes += numIndices*sizeof(GLushort);
+
+    // The element buffer binding is part of the VAO state
+    glGenBuffers (1, &(vao->IndexBuffer)); // VBO - indices
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer);
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, numIndices*sizeof(GLushort), indices, GL_STATIC_DRAW);
+
+    return vao;
+}
+
+/* Generate VAO, VBOs and return VAO handle - separate x,y,z and r,g,b arrays */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+    vector<VertexP3C4> vertices(numVertices);
+    for (int i=0; i<numVertices; i++) {
+        VertexP3C4 &v = vertices[i];
+        v.x = vertex_buffer_data [3*i];
+        v.y = vertex_buffer_data [3*i + 1];
+        v.z = vertex_buffer_data [3*i + 2];
+        v.r = colorByte(color_buffer_data [3*i]);
+        v.g = colorByte(color_buffer_data [3*i + 1]);
+        v.b = colorByte(color_buffer_data [3*i + 2]);
+        v.a = 255;
+    }
+
+    return create3DObject(primitive_mode, numVertices, &vertices[0], fill_mode);
+}
+
+/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+{
+    vector<GLfloat> color_buffer_data(3*numVertices);
+    for (int i=0; i<numVertices; i++) {
+        color_buffer_data [3*i] = red;
+        color_buffer_data [3*i + 1] = green;
+        color_buffer_data [3*i + 2] = blue;
+    }
+
+    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, &color_buffer_data[0], fill_mode);
+}
+
+/* Free the VAO and its VBOs */
+void destroy3DObject (struct VAO* vao)
+{
+    Meshes.liveVAOs--;
+    Meshes.liveBuffers -= vao->NumBuffers;
+    Meshes.liveBytes -= vao->Bytes;
+
+    if (!Meshes.contextLost) {
+      glDeleteBuffers (1, &(vao->VertexBuffer));
+      if (vao->IndexBuffer)
+        glDeleteBuffers (1, &(vao->IndexBuffer));
+      glDeleteVertexArrays (1, &(vao->VertexArrayID));
+      // The name may be handed out again, don't let the cache match it
+      if (GLState.vertexArray == vao->VertexArrayID)
+        GLState.vertexArray = 0;
+      GLState.enabledAttribs.erase(vao->VertexArrayID);
+    }
+
+    delete vao;
+}
+
+/* Reference counted handle to a VAO, the VAO is freed when the last handle goes away */
+class MeshRef {
+public:
+  MeshRef() : vao(NULL) {}
+  explicit MeshRef(VAO* v) : vao(v) { acquire(); }
+  MeshRef(const MeshRef &o) : vao(o.vao) { acquire(); }
+  ~MeshRef() { release(); }
+  MeshRef& operator= (const MeshRef &o){
+    if (o.vao != vao) {
+      release();
+      vao = o.vao;
+      acquire();
+    }
+    return *this;
+  }
+  VAO* get() const { return vao; }
+  VAO* operator-> () const { return vao; }
+
+private:
+  VAO* vao;
+  void acquire(){
+    if (!vao) return;
+    if (vao->RefCount++ == 0) {
+      Meshes.liveVAOs++;
+      Meshes.liveBuffers += vao->NumBuffers;
+      Meshes.liveBytes += vao->Bytes;
+    }
+  }
+  void release(){
+    if (vao && --vao->RefCount == 0)
+      destroy3DObject(vao);
+    vao = NULL;
+  }
+};
+
+void printMeshStats ()
+{
+    cout << "Meshes: " << Meshes.liveVAOs << " VAOs, "
+         << Meshes.liveBuffers << " buffers, " << Meshes.liveBytes << " bytes" << endl;
+}
+
+/* Uniform blocks shared by every program, std140 layout (see the shaders) */
+#define CAMERA_BINDING 0 // Camera { mat4 VP; }
+#define OBJECT_BINDING 1 // Object { mat4 model; }
+
+/* View-projection, written once per frame */
+struct CameraBlock {
+    GLuint Buffer;
+} CameraUBO;
+
+/* Model matrices of the frame's non-instanced draws, uploaded with a single
+   glBufferSubData and selected per draw with glBindBufferRange.
+   Slot 0 always holds the identity, used by instanced draws. */
+struct TransformBlock {
+    GLuint Buffer;
+    int stride;   // bytes per slot, rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+    int capacity; // slots the GPU buffer can hold
+    int count;    // slots used this frame
+    vector<char> staging;
+} Transforms;
+
+void initUniformBlocks ()
+{
+    glGenBuffers (1, &CameraUBO.Buffer);
+    glBindBuffer (GL_UNIFORM_BUFFER, CameraUBO.Buffer);
+    glBufferData (GL_UNIFORM_BUFFER, sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase (GL_UNIFORM_BUFFER, CAMERA_BINDING, CameraUBO.Buffer);
+
+    GLint alignment = 256;
+    glGetIntegerv (GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    Transforms.stride = ((sizeof(glm::mat4) + alignment - 1) / alignment) * alignment;
+    Transforms.capacity = 0;
+    Transforms.count = 0;
+    glGenBuffers (1, &Transforms.Buffer);
+}
+
+/* Point a program's blocks at the shared binding points */
+void bindUniformBlocks (GLuint program)
+{
+    GLuint camera = glGetUniformBlockIndex(program, "Camera");
+    if (camera != GL_INVALID_INDEX)
+      glUniformBlockBinding(program, camera, CAMERA_BINDING);
+    GLuint object = glGetUniformBlockIndex(program, "Object");
+    if (object != GL_INVALID_INDEX)
+      glUniformBlockBinding(program, object, OBJECT_BINDING);
+}
+
+void uploadCamera (glm::mat4 &VP)
+{
+    glBindBuffer (GL_UNIFORM_BUFFER, CameraUBO.Buffer);
+    glBufferSubData (GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), &VP[0][0]);
+}
+
+/* Queue a model matrix for this frame and return its slot */
+int pushTransform (const glm::mat4 &model)
+{
+    int slot = Transforms.count++;
+    if ((int) Transforms.staging.size() < Transforms.count*Transforms.stride)
+      Transforms.staging.resize(2*Transforms.count*Transforms.stride);
+    memcpy(&Transforms.staging[slot*Transforms.stride], &model[0][0], sizeof(glm::mat4));
+    return slot;
+}
+
+void beginTransforms ()
+{
+    Transforms.count = 0;
+    pushTransform(glm::mat4(1.0f));
+}
+
+void uploadTransforms ()
+{
+    glBindBuffer (GL_UNIFORM_BUFFER, Transforms.Buffer);
+    if (Transforms.count > Transforms.capacity) {
+      Transforms.capacity = max(Transforms.count, 2*Transforms.capacity);
+      glBufferData (GL_UNIFORM_BUFFER, Transforms.capacity*Transforms.stride, NULL, GL_STREAM_DRAW);
+    }
+    glBufferSubData (GL_UNIFORM_BUFFER, 0, Transforms.count*Transforms.stride, &Transforms.staging[0]);
+}
+
+void bindTransform (int slot)
+{
+    cachedBindBufferRange (GL_UNIFORM_BUFFER, OBJECT_BINDING, Transforms.Buffer, slot*Transforms.stride, sizeof(glm::mat4));
+}
+
+/* Per-instance data read by attributes 2 and 3 of Sample_GL.vert */
+struct InstanceData {
+    GLfloat offset[2];
+    GLfloat scale[2];
+    GLfloat color[3];
+};
+
+/* Constant values of the color and instance attributes when their arrays are
+   disabled, so that non-instanced objects are drawn untransformed and untinted
+   and position-only meshes take their color from the instance attribute */
+void resetInstanceAttributes ()
+{
+    glVertexAttrib4f(1, 1, 1, 1, 1);
+    glVertexAttrib4f(2, 0, 0, 1, 1);
+    glVertexAttrib3f(3, 1, 1, 1);
+}
+
+/* Read attributes 2 and 3 of the VAO from 'buffer', starting 'base' bytes in */
+void pointInstances (struct VAO* vao, GLuint buffer, size_t base)
+{
+    cachedBindVertexArray (vao->VertexArrayID);
+    glBindBuffer (GL_ARRAY_BUFFER, buffer);
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)base); // offset + scale
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(base + 4*sizeof(GLfloat))); // color
+}
+
+/* Make attributes 2 and 3 of an existing VAO per-instance (divisor 1) */
+void setupInstancing (struct VAO* vao, GLuint buffer)
+{
+    pointInstances(vao, buffer, 0);
+
+    cachedEnableVertexAttribArray(2);
+    glVertexAttribDivisor(2, 1);
+
+    cachedEnableVertexAttribArray(3);
+    glVertexAttribDivisor(3, 1);
+}
+
+/* Render numInstances copies of the VAO, one per entry of its instance buffer */
+void draw3DObjectInstanced (struct VAO* vao, int numInstances)
+{
+    cachedPolygonMode (vao->FillMode);
+    cachedBindVertexArray (vao->VertexArrayID);
+
+    if (vao->IndexBuffer)
+      glDrawElementsInstanced(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_SHORT, (void*)0, numInstances);
+    else
+      glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, numInstances);
+
+    // Current attribute values are undefined after drawing with the arrays enabled
+    resetInstanceAttributes();
+}
+
+
+/* Camera : looks down at the z = 0 plane from z = 3. Owns the pan, the zoom
+   (a field of view, also used to size the orthographic view) and the
+   framebuffer size; VP and its inverse are rebuilt only after one changed. */
+#define CAMERA_DISTANCE 3.0f
+#define FOV_MAX 2.498f // the whole 32x18 level at 16:9
+
+struct Camera {
+    float panX, panY;    // world point at the center of the view
+    float fov;
+    int width, height;   // framebuffer
+    int ortho;           // 0 - perspective, 1 - orthographic
+    int dirty;
+    glm::mat4 view, projection, VP, inverseVP;
+} Cam = { 0, 0, FOV_MAX, 1280, 720, 1, 1,
+          glm::mat4(1.0f), glm::mat4(1.0f), glm::mat4(1.0f), glm::mat4(1.0f) };
+
+/* World half-height visible at z = 0 */
+float cameraHalfHeight ()
+{
+    return CAMERA_DISTANCE*tan(Cam.fov/2);
+}
+
+void panCamera (float dx, float dy)
+{
+    if (dx == 0 && dy == 0) return;
+    Cam.panX += dx; Cam.panY += dy;
+    Cam.dirty = 1;
+}
+
+void zoomCamera (float fov)
+{
+    fov = min(fov, FOV_MAX);
+    if (fov <= 0 || fov == Cam.fov) return;
+    Cam.fov = fov;
+    Cam.dirty = 1;
+}
+
+void setCameraViewport (int width, int height)
+{
+    if (width == Cam.width && height == Cam.height) return;
+    Cam.width = width; Cam.height = height;
+    Cam.dirty = 1;
+}
+
+void toggleCameraProjection ()
+{
+    Cam.ortho = !Cam.ortho;
+    Cam.dirty = 1;
+}
+
+/* Rebuild the matrices if anything changed, true if it did */
+bool updateCamera ()
+{
+    if (!Cam.dirty)
+      return false;
+    float aspect = (float) Cam.width / (float) max(Cam.height, 1);
+    Cam.view = glm::lookAt(glm::vec3(Cam.panX, Cam.panY, CAMERA_DISTANCE), glm::vec3(Cam.panX, Cam.panY, 0), glm::vec3(0, 1, 0));
+    if (Cam.ortho) {
+      float h = cameraHalfHeight();
+      Cam.projection = glm::ortho(-h*aspect, h*aspect, -h, h, 0.1f, 500.0f);
+    }
+    else
+      Cam.projection = glm::perspective(Cam.fov, aspect, 0.1f, 500.0f);
+    Cam.VP = Cam.projection * Cam.view;
+    Cam.inverseVP = glm::inverse(Cam.VP);
+    Cam.dirty = 0;
+    return true;
+}
+
+/* World rectangle seen at z = 0: minX, minY, maxX, maxY */
+void cameraBounds (float bounds[4])
+{
+    float h = cameraHalfHeight(), w = h*Cam.width/max(Cam.height, 1);
+    bounds[0] = Cam.panX - w; bounds[1] = Cam.panY - h;
+    bounds[2] = Cam.panX + w; bounds[3] = Cam.panY + h;
+}
+
+/* Point of the z = 0 plane under window position (x, y), window sized w x h.
+   Intersects the eye ray with the plane, so it is exact for both projections. */
+void screenToWorld (double x, double y, int w, int h, double &worldX, double &worldY)
+{
+    updateCamera();
+    float ndcX = 2*x/w - 1, ndcY = 1 - 2*y/h;
+    glm::vec4 nearPoint = Cam.inverseVP * glm::vec4(ndcX, ndcY, -1, 1);
+    glm::vec4 farPoint = Cam.inverseVP * glm::vec4(ndcX, ndcY, 1, 1);
+    float nearZ = nearPoint.z/nearPoint.w, farZ = farPoint.z/farPoint.w;
+    float t = nearZ/(nearZ - farZ);
+    worldX = (1-t)*nearPoint.x/nearPoint.w + t*farPoint.x/farPoint.w;
+    worldY = (1-t)*nearPoint.y/nearPoint.w + t*farPoint.y/farPoint.w;
+}
+
+/* Visibility counts of the last frame, objects are render queue packets */
+struct CullStats {
+    int visibleObjects, culledObjects;
+    int visibleCells, culledCells;
+} Culling;
+
+int showHUD = 1; // 'h' toggles the overlay
+int hudTimings = 1; // FPS and GPU lines; off headless, where a frame must not depend on timing
+
+void printCullStats ()
+{
+    cout << "Visible objects: " << Culling.visibleObjects << ", culled: " << Culling.culledObjects
+         << " - level cells visible: " << Culling.visibleCells << ", culled: " << Culling.culledCells << endl;
+}
+
+/* Frame scheduler : paces the main loop without burning a core. It sleeps
+   until SCHEDULER_SPIN before the frame's deadline, so the sleep's wake up
+   jitter does not matter, and spins the rest. With no cap the swap interval
+   alone paces the loop; a minimized window only waits for events. */
+#define SCHEDULER_SPIN 0.0005 // seconds
+#define SCHEDULER_IDLE 0.25   // seconds between wake ups while minimized
+
+struct FrameScheduler {
+    double cap;       // frames per second, 0 - none
+    int swapInterval; // 0 - off, 1 - vsync, -1 - adaptive: late frames tear instead of waiting
+    double next;      // deadline of the next frame, monotonic seconds
+    long late;        // frames that started after their deadline, with vsync off
+} Scheduler = { 100, 1, 0, 0 };
+
+double monotonicSeconds ()
+{
+#ifdef __linux__
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+#else
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void sleepUntil (double deadline)
+{
+#ifdef __linux__
+    struct timespec t;
+    t.tv_sec = (time_t) deadline;
+    t.tv_nsec = (long) ((deadline - t.tv_sec)*1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+      ;
+#else
+    std::this_thread::sleep_for(std::chrono::duration<double>(deadline - monotonicSeconds()));
+#endif
+}
+
+/* Block until the next frame is due; a frame that ran late starts the next one right away.
+   With vsync on, a cap above the refresh rate misses every deadline by design,
+   so only frames paced by the cap alone count as late. */
+void waitForFrame ()
+{
+    if (Scheduler.cap <= 0)
+      return;
+    double now = monotonicSeconds();
+    Scheduler.next += 1/Scheduler.cap;
+    if (Scheduler.next <= now) {
+      if (Scheduler.swapInterval == 0)
+        Scheduler.late++;
+      Scheduler.next = now;
+      return;
+    }
+    if (Scheduler.next - now > SCHEDULER_SPIN)
+      sleepUntil(Scheduler.next - SCHEDULER_SPIN);
+    while (monotonicSeconds() < Scheduler.next)
+      ;
+}
+
+void setFrameCap (double fps)
+{
+    Scheduler.cap = fps;
+    Scheduler.next = monotonicSeconds();
+}
+
+/* Needs the window's context current; adaptive vsync falls back to vsync where unsupported */
+void setSwapInterval (int interval)
+{
+    if (interval < 0 && !glfwExtensionSupported("GLX_EXT_swap_control_tear")
+                     && !glfwExtensionSupported("WGL_EXT_swap_control_tear"))
+      interval = 1;
+    Scheduler.swapInterval = interval;
+    glfwSwapInterval(interval);
+}
+
+void printScheduler ()
+{
+    static const char* modes[] = { "adaptive", "off", "on" };
+    cout << "Frame cap: ";
+    if (Scheduler.cap > 0)
+      cout << Scheduler.cap << " fps";
+    else
+      cout << "none";
+    cout << ", vsync: " << modes[Scheduler.swapInterval + 1] << ", late frames: " << Scheduler.late << endl;
+}
+
+/* Executed when a mouse button is pressed/released */
+
+
+/* Executed when window is resized to 'width' and 'height' */
+/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+void reshapeWindow (GLFWwindow* window, int width, int height)
+{
+    int fbwidth=width, fbheight=height;
+    /* With Retina display on Mac OS X, GLFW's FramebufferSize
+     is different from WindowSize */
+    if (window) // NULL when rendering headless
+      glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+
+	// sets the viewport of openGL renderer
+	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+
+	// the camera rebuilds its projection for the new aspect ratio
+	setCameraViewport(fbwidth, fbheight);
+	resizeCapture(fbwidth, fbheight);
+}
+
+VAO *triangle, *rectangle, *circle;
+
+// Creates the triangle object used in this sample code
+void createTriangle ()
+{
+  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+
+  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
+  static const GLfloat vertex_buffer_data [] = {
+    0, 1,0, // vertex 0
+    -1,-1,0, // vertex 1
+    1,-1,0, // vertex 2
+  };
+
+  static const GLfloat color_buffer_data [] = {
+    1,0,0, // color 0
+    0,1,0, // color 1
+    0,0,1, // color 2
+  };
+
+  // create3DObject creates and returns a handle to a VAO that can be used later
+  triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+}
+
+
+/* Position-only unit meshes for the instanced path : radius 1 circle, 1x1 square */
+VAO* createUnitCircle (int segments, GLenum fill_mode = GL_FILL)
+{
+  // Indexed triangle fan : center, then the rim, closed by repeating its first point
+  vector<VertexP2> vertices(segments+1);
+  vector<GLushort> indices(segments+2);
+  vertices[0].x = 0; vertices[0].y = 0;
+  indices[0] = 0;
+  for(int k=0; k<segments; k++){
+    vertices[k+1].x = cos(2.0*M_PI*k/segments);
+    vertices[k+1].y = sin(2.0*M_PI*k/segments);
+    indices[k+1] = k+1;
+  }
+  indices[segments+1] = 1;
+  return create3DObject(GL_TRIANGLE_FAN, segments+1, &vertices[0], segments+2, &indices[0], fill_mode);
+}
+
+VAO* createUnitSquare ()
+{
+  VertexP2 vertices [] = {
+    {0,0}, {0,1}, {1,1},
+    {1,1}, {1,0}, {0,0}
+  };
+  return create3DObject(GL_TRIANGLES, 6, vertices, GL_FILL);
+}
+
+/* Quad bounding the unit circle, shaded analytically by Sample_GL_circle.frag */
+VAO* createCircleQuad ()
+{
+  VertexP2 vertices [] = {
+    {-1,-1}, {-1,1}, {1,1},
+    {1,1}, {1,-1}, {-1,-1}
+  };
+  return create3DObject(GL_TRIANGLES, 6, vertices, GL_FILL);
+}
+
+/* Circle meshes: 8, 16, ... 256 segments, one unit mesh per bucket and fill mode */
+#define LOD_BUCKETS 6
+#define LOD_MIN_SEGMENTS 8
+#define LOD_TOLERANCE 0.25 // Largest allowed gap between mesh and true circle, in pixels
+
+/* Pixels per world unit the simulation picks circle meshes for. The camera
+   belongs to the render thread, which sends this with INPUT_VIEW as it changes. */
+float lodPixelsPerUnit = 40;
+
+/* Radius in pixels of a circle of world radius r */
+float projectedRadius (float r)
+{
+  return r*lodPixelsPerUnit;
+}
+
+/* Smallest bucket whose chords stay within LOD_TOLERANCE pixels of the circle */
+int circleLOD (float r)
+{
+  float pixels = projectedRadius(r);
+  int segments = LOD_MIN_SEGMENTS;
+  if (pixels > LOD_TOLERANCE)
+    segments = ceil(M_PI/acos(1 - LOD_TOLERANCE/pixels));
+  int bucket = 0;
+  while (bucket < LOD_BUCKETS-1 && (LOD_MIN_SEGMENTS << bucket) < segments) bucket++;
+  return bucket;
+}
+
+/* Streaming buffer : per-frame data of moving objects goes to one of
+   STREAM_REGIONS regions, used round robin. A region is written unsynchronized,
+   its fence from STREAM_REGIONS frames ago tells whether the GPU is done with it.
+   If it is not, the storage is orphaned instead of waiting on it. */
+#define STREAM_REGIONS 3
+
+struct StreamBuffer {
+    GLuint Buffer;
+    size_t regionBytes;            // bytes a frame may write
+    size_t used;                   // bytes written in the current region
+    int region;                    // region of the current frame
+    GLsync fence[STREAM_REGIONS];  // signalled once the region's draws are done
+    int orphans;                   // frames which found their region still busy
+} Stream;
+
+void initStreamBuffer ()
+{
+    glGenBuffers (1, &Stream.Buffer);
+    Stream.regionBytes = Stream.used = 0;
+    Stream.region = 0;
+    for (int i = 0; i < STREAM_REGIONS; i++)
+      Stream.fence[i] = 0;
+    Stream.orphans = 0;
+    Meshes.liveBuffers++;
+}
+
+void dropStreamFences ()
+{
+    for (int i = 0; i < STREAM_REGIONS; i++)
+      if (Stream.fence[i]) {
+        glDeleteSync(Stream.fence[i]);
+        Stream.fence[i] = 0;
+      }
+}
+
+/* New storage for the buffer; draws already issued keep the old one */
+void orphanStream (size_t regionBytes)
+{
+    Meshes.liveBytes += (long) (regionBytes - Stream.regionBytes)*STREAM_REGIONS;
+    Stream.regionBytes = regionBytes;
+    glBufferData (GL_ARRAY_BUFFER, regionBytes*STREAM_REGIONS, NULL, GL_STREAM_DRAW);
+    dropStreamFences();
+}
+
+/* Space 'bytes' takes in a region, writes are 16 byte aligned */
+size_t streamBytes (size_t bytes)
+{
+    return (bytes + 15) & ~(size_t) 15;
+}
+
+/* Make room for 'bytes' more in the current region. Growing orphans the
+   buffer and drops what the frame mapped so far, so a frame reserves all it
+   streams before the first of its draws, and its mapStream calls then fit. */
+void reserveStream (size_t bytes)
+{
+    glBindBuffer (GL_ARRAY_BUFFER, Stream.Buffer);
+    if (Stream.used + bytes > Stream.regionBytes) {
+      orphanStream(max(2*Stream.regionBytes, Stream.used + bytes));
+      Stream.region = 0;
+      Stream.used = 0;
+    }
+    if (Stream.used == 0 && Stream.fence[Stream.region]) {
+      // First write of the frame to this region - never wait for the GPU
+      GLenum status = glClientWaitSync(Stream.fence[Stream.region], 0, 0);
+      if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED) {
+        orphanStream(Stream.regionBytes);
+        Stream.orphans++;
+      }
+      else {
+        glDeleteSync(Stream.fence[Stream.region]);
+        Stream.fence[Stream.region] = 0;
+      }
+    }
+}
+
+/* Map 'bytes' of the current region for writing, 'offset' receives their place in
+   Stream.Buffer; within a frame they must fit in what reserveStream made room for */
+void* mapStream (size_t bytes, size_t &offset)
+{
+    reserveStream(bytes);
+    offset = Stream.region*Stream.regionBytes + Stream.used;
+    Stream.used += streamBytes(bytes);
+    if (Stream.used > Stream.regionBytes)
+      Stream.used = Stream.regionBytes;
+    return glMapBufferRange(GL_ARRAY_BUFFER, offset, bytes,
+                            GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+}
+
+void unmapStream ()
+{
+    glBindBuffer (GL_ARRAY_BUFFER, Stream.Buffer);
+    glUnmapBuffer (GL_ARRAY_BUFFER);
+}
+
+/* Called once the frame's draws are issued: fence the region and move on */
+void endStreamFrame ()
+{
+    if (Stream.used == 0)
+      return;
+    if (Stream.fence[Stream.region])
+      glDeleteSync(Stream.fence[Stream.region]);
+    Stream.fence[Stream.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    Stream.region = (Stream.region + 1) % STREAM_REGIONS;
+    Stream.used = 0;
+}
+
+void printStreamStats ()
+{
+    cout << "Stream: " << STREAM_REGIONS << " regions of " << Stream.regionBytes << " bytes, "
+         << Stream.orphans << " orphaned on a busy region" << endl;
+}
+
+/* Glyph atlas : a 5x7 bitmap font for ' ' to '_' (lowercase is drawn as
+   uppercase), one byte per column, bit 0 at the top. Each glyph gets a 6x8
+   cell of a 16x4 cell single channel texture. */
+#define FONT_FIRST 32
+#define FONT_GLYPHS 64
+#define FONT_CELL_W 6
+#define FONT_CELL_H 8
+
+static const GLubyte fontColumns[FONT_GLYPHS][5] = {
+    {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7F,0x14,0x7F,0x14}, //  !"#
+    {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62}, {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00}, // $%&'
+    {0x00,0x1C,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1C,0x00}, {0x08,0x2A,0x1C,0x2A,0x08}, {0x08,0x08,0x3E,0x08,0x08}, // ()*+
+    {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02}, // ,-./
+    {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00}, {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31}, // 0123
+    {0x18,0x14,0x12,0x7F,0x10}, {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03}, // 4567
+    {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00}, // 89:;
+    {0x00,0x08,0x14,0x22,0x41}, {0x14,0x14,0x14,0x14,0x14}, {0x41,0x22,0x14,0x08,0x00}, {0x02,0x01,0x51,0x09,0x06}, // <=>?
+    {0x32,0x49,0x79,0x41,0x3E}, {0x7E,0x11,0x11,0x11,0x7E}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22}, // @ABC
+    {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x01,0x01}, {0x3E,0x41,0x41,0x51,0x32}, // DEFG
+    {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00}, {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41}, // HIJK
+    {0x7F,0x40,0x40,0x40,0x40}, {0x7F,0x02,0x04,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E}, // LMNO
+    {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31}, // PQRS
+    {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F}, {0x1F,0x20,0x40,0x20,0x1F}, {0x7F,0x20,0x18,0x20,0x7F}, // TUVW
+    {0x63,0x14,0x08,0x14,0x63}, {0x03,0x04,0x78,0x04,0x03}, {0x61,0x51,0x49,0x45,0x43}, {0x00,0x00,0x7F,0x41,0x41}, // XYZ[
+    {0x02,0x04,0x08,0x10,0x20}, {0x41,0x41,0x7F,0x00,0x00}, {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40}, // \]^_
+};
+
+struct FontAtlas {
+    GLuint Texture;
+    int width, height; // texels
+} Font;
+
+void initFontAtlas ()
+{
+    Font.width = 16*FONT_CELL_W; Font.height = (FONT_GLYPHS/16)*FONT_CELL_H;
+    vector<GLubyte> texels(Font.width*Font.height, 0);
+    for (int g = 0; g < FONT_GLYPHS; g++) {
+      int cellX = (g % 16)*FONT_CELL_W, cellY = (g / 16)*FONT_CELL_H;
+      for (int x = 0; x < 5; x++)
+        for (int y = 0; y < 7; y++)
+          if (fontColumns[g][x] & (1 << y))
+            texels[(cellY + y)*Font.width + cellX + x] = 255;
+    }
+
+    glGenTextures(1, &Font.Texture);
+    glBindTexture(GL_TEXTURE_2D, Font.Texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, Font.width, Font.height, 0, GL_RED, GL_UNSIGNED_BYTE, &texels[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // crisp pixels at integer scales
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    Meshes.liveBytes += Font.width*Font.height;
+}
+
+/* Text batch : every glyph quad of the frame, drawn as one packet */
+struct TextBatch {
+    vector<VertexP2T2C4> vertices;
+} Text;
+
+/* Queue 'text' with its top left corner at pixel (x, y), glyphs 'scale' texels per pixel */
+void addText (float x, float y, float scale, const char* text, const float color[4])
+{
+    VertexP2T2C4 v;
+    v.r = colorByte(color[0]); v.g = colorByte(color[1]); v.b = colorByte(color[2]); v.a = colorByte(color[3]);
+    float w = FONT_CELL_W*scale, h = FONT_CELL_H*scale;
+    for (const char* c = text; *c; c++, x += w) {
+      int g = toupper((unsigned char) *c) - FONT_FIRST;
+      if (g <= 0 || g >= FONT_GLYPHS)
+        continue; // space and anything the font lacks
+      float u0 = (float) ((g % 16)*FONT_CELL_W)/Font.width, v0 = (float) ((g / 16)*FONT_CELL_H)/Font.height;
+      float u1 = u0 + (float) FONT_CELL_W/Font.width, v1 = v0 + (float) FONT_CELL_H/Font.height;
+      const float corners[6][4] = { {x,y,u0,v0}, {x+w,y,u1,v0}, {x+w,y+h,u1,v1}, {x,y,u0,v0}, {x+w,y+h,u1,v1}, {x,y+h,u0,v1} };
+      for (int k = 0; k < 6; k++) {
+        v.x = corners[k][0]; v.y = corners[k][1]; v.u = corners[k][2]; v.v = corners[k][3];
+        Text.vertices.push_back(v);
+      }
+    }
+}
+
+void drawText (VAO* vao)
+{
+    int n = Text.vertices.size();
+    if (n == 0)
+      return;
+    size_t base;
+    VertexP2T2C4* v = (VertexP2T2C4*) mapStream(n*sizeof(VertexP2T2C4), base);
+    memcpy(v, &Text.vertices[0], n*sizeof(VertexP2T2C4));
+    unmapStream();
+    Text.vertices.clear();
+
+    pointVertices<VertexP2T2C4>(vao, Stream.Buffer, base);
+    cachedPolygonMode (vao->FillMode);
+    glDrawArrays(GL_TRIANGLES, 0, n);
+}
+
+/* Render queue : the simulation only describes the frame as draw packets.
+   submitRenderQueue sorts them by state and issues them in one pass,
+   merging runs of packets with the same key into one instanced draw. */
+
+// Draw order, the most significant part of the key since everything is at z = 0
+#define LAYER_GUN 0
+#define LAYER_LEVEL 1
+#define LAYER_PREVIEW 2
+#define LAYER_TARGET 3
+#define LAYER_CIRCLES 4
+#define LAYER_PARTICLES 5
+#define LAYER_HUD 6
+
+#define PROGRAM_BASIC 0  // Sample_GL.vert/.frag
+#define PROGRAM_CIRCLE 1 // Sample_GL_circle.vert/.frag, filled circles
+#define PROGRAM_RINGS 2  // Sample_GL_circle.vert/.frag, with the target's rings
+#define PROGRAM_PARTICLES 3 // Sample_GL_particle.vert/.frag
+#define PROGRAM_TEXT 4      // Sample_GL_text.vert/.frag
+
+// Unit meshes, sized and colored per instance
+#define MESH_QUAD 0        // [0, 1] square
+#define MESH_CIRCLE_QUAD 1 // [-1, 1] square around the unit circle
+#define MESH_CIRCLE_LOD 2  // unit circle fans, largest bucket first so small circles end up on top
+// From here on, one packet draws geometry that is already placed, and is never culled
+#define MESH_LEVEL (MESH_CIRCLE_LOD + LOD_BUCKETS) // the baked walls and platforms, already in world space
+#define MESH_PARTICLES (MESH_LEVEL + 1) // point sprites streamed from the particle pool
+#define MESH_PREVIEW (MESH_PARTICLES + 1)   // line strip streamed from the trajectory preview
+#define MESH_TEXT (MESH_PREVIEW + 1)        // glyph quads streamed from the text batch
+#define MESH_COUNT (MESH_TEXT + 1)
+
+struct DrawPacket {
+    uint64_t key; // layer | program | mesh | fill mode | transform slot
+    InstanceData instance;
+    float previous[2]; // instance offset one simulation step earlier
+};
+
+/* Snapshot : everything the render thread needs from one simulation step.
+   The simulation thread fills the back buffer and publishes it; from then on
+   it is read only. With three buffers the simulation always has one to write
+   and the renderer always has the newest complete one, and neither waits.
+   Vectors are cleared rather than freed, so warm snapshots do not allocate. */
+struct LevelGeometry;
+
+struct Snapshot {
+    vector<DrawPacket> packets;
+    vector<glm::mat4> transforms;  // model matrix of transform slot i+1, slot 0 is the identity
+    int ringCount;                 // rings of PROGRAM_RINGS, outermost first
+    GLfloat ringRadius[MAX_RINGS], ringColor[3*MAX_RINGS];
+    vector<VertexP2C4S> particles; // MESH_PARTICLES point sprites
+    vector<float> path;            // MESH_PREVIEW, x, y per step
+    std::shared_ptr<const LevelGeometry> geometry; // MESH_LEVEL, shared with the bake
+    int level, shots, particleCount; // for the HUD
+    // The renderer shows the previous step's state at blendStart and this
+    // one SIM_STEP later, blending the packets of moving objects in between
+    std::chrono::steady_clock::time_point blendStart;
+};
+
+#define SNAPSHOT_FRESH 4 // in 'latest' until the render thread takes it
+
+struct SnapshotBuffers {
+    Snapshot buffers[3];
+    std::atomic<int> latest; // last published buffer, | SNAPSHOT_FRESH
+    int back;                // being written, simulation thread only
+    int front;               // being drawn, render thread only
+} Snapshots;
+
+Snapshot* Frame; // Snapshots.buffers[back], what the simulation describes the world to
+
+void clearSnapshot (Snapshot &s)
+{
+    s.packets.clear();
+    s.transforms.clear();
+    s.ringCount = 0;
+    s.particles.clear();
+    s.path.clear();
+    s.geometry.reset();
+}
+
+void initSnapshots ()
+{
+    for (int i = 0; i < 3; i++)
+      clearSnapshot(Snapshots.buffers[i]);
+    Snapshots.back = 0;
+    Snapshots.latest = 1;
+    Snapshots.front = 2;
+    Frame = &Snapshots.buffers[Snapshots.back];
+}
+
+/* Simulation thread: hand over the back buffer, take back whichever the render thread is not using */
+void publishSnapshot ()
+{
+    Snapshots.back = Snapshots.latest.exchange(Snapshots.back | SNAPSHOT_FRESH) & 3;
+    Frame = &Snapshots.buffers[Snapshots.back];
+    clearSnapshot(*Frame);
+}
+
+/* Render thread: the newest published snapshot, or the last one drawn if none came since */
+const Snapshot& acquireSnapshot ()
+{
+    if (Snapshots.latest.load() & SNAPSHOT_FRESH)
+      Snapshots.front = Snapshots.latest.exchange(Snapshots.front) & 3;
+    return Snapshots.buffers[Snapshots.front];
+}
+
+struct RenderQueue {
+    vector<DrawPacket> packets, scratch;
+    const Snapshot* snapshot; // the frame's, for the meshes streamed from it
+
+    // GPU side, only used by submitRenderQueue
+    MeshRef meshes[MESH_COUNT][2]; // [mesh][0 - GL_FILL, 1 - GL_LINE]
+    int draws;                     // draw calls issued by the last submit
+} Queue;
+
+uint64_t drawKey (int layer, int program, int mesh, GLenum fill, int slot)
+{
+    return ((uint64_t) layer << 60) | ((uint64_t) program << 56) | ((uint64_t) mesh << 40)
+         | ((uint64_t) (fill == GL_LINE) << 39) | ((uint64_t) slot << 23);
+}
+
+InstanceData makeInstance (double x, double y, double scaleX, double scaleY, const double color[3])
+{
+    InstanceData d;
+    d.offset[0] = x; d.offset[1] = y;
+    d.scale[0] = scaleX; d.scale[1] = scaleY;
+    d.color[0] = color[0]; d.color[1] = color[1]; d.color[2] = color[2];
+    return d;
+}
+
+DrawPacket makePacket (int layer, int program, int mesh, GLenum fill, int slot, const InstanceData &instance)
+{
+    DrawPacket p;
+    p.key = drawKey(layer, program, mesh, fill, slot);
+    p.instance = instance;
+    p.previous[0] = instance.offset[0]; p.previous[1] = instance.offset[1];
+    return p;
+}
+
+/* Simulation thread: queue a draw in the snapshot being built */
+void pushDraw (int layer, int program, int mesh, GLenum fill, int slot, const InstanceData &instance)
+{
+    Frame->packets.push_back(makePacket(layer, program, mesh, fill, slot, instance));
+}
+
+/* Simulation thread: a draw that was at (x, y) one step ago, blended by the renderer */
+void pushMovingDraw (int layer, int program, int mesh, GLenum fill, const InstanceData &instance, double x, double y)
+{
+    Frame->packets.push_back(makePacket(layer, program, mesh, fill, 0, instance));
+    Frame->packets.back().previous[0] = x; Frame->packets.back().previous[1] = y;
+}
+
+/* Simulation thread: the transform slot 'model' will have when the snapshot is drawn */
+int emitTransform (const glm::mat4 &model)
+{
+    Frame->transforms.push_back(model);
+    return Frame->transforms.size();
+}
+
+/* Render thread: where between the snapshot's previous and current step 'now' falls, 0 to 1 */
+float snapshotBlend (const Snapshot &s, std::chrono::steady_clock::time_point now)
+{
+    float t = std::chrono::duration<double>(now - s.blendStart).count()/SIM_STEP;
+    return t < 0 ? 0 : t > 1 ? 1 : t;
+}
+
+/* Render thread: queue a snapshot's draws and transforms for this frame,
+   moving objects placed 'blend' of the way from their previous position */
+void loadSnapshot (const Snapshot &s, float blend)
+{
+    for (size_t i = 0; i < s.transforms.size(); i++)
+      pushTransform(s.transforms[i]);
+    size_t first = Queue.packets.size();
+    Queue.packets.insert(Queue.packets.end(), s.packets.begin(), s.packets.end());
+    for (size_t i = first; i < Queue.packets.size(); i++) {
+      DrawPacket &p = Queue.packets[i];
+      p.instance.offset[0] = p.previous[0] + blend*(p.instance.offset[0] - p.previous[0]);
+      p.instance.offset[1] = p.previous[1] + blend*(p.instance.offset[1] - p.previous[1]);
+    }
+    Queue.snapshot = &s;
+}
+
+/* Mesh id of the circle fan for a circle of world radius r */
+int circleMesh (float r)
+{
+    return MESH_CIRCLE_LOD + (LOD_BUCKETS-1 - circleLOD(r));
+}
+
+/* Stable LSD radix sort of the packets on their 64 bit keys, one byte per pass.
+   Passes where all keys share the byte are skipped, which is most of them. */
+void sortRenderQueue ()
+{
+    vector<DrawPacket> &src = Queue.packets, &dst = Queue.scratch;
+    size_t n = src.size();
+    dst.resize(n);
+    for (int shift = 0; shift < 64; shift += 8) {
+      size_t count[256] = {0};
+      for (size_t i = 0; i < n; i++)
+        count[(src[i].key >> shift) & 0xff]++;
+      if (count[(src[0].key >> shift) & 0xff] == n)
+        continue;
+
+      size_t offset = 0;
+      for (int b = 0; b < 256; b++) {
+        size_t c = count[b];
+        count[b] = offset;
+        offset += c;
+      }
+      for (size_t i = 0; i < n; i++)
+        dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+      src.swap(dst);
+    }
+}
+
+/* Walls and platforms never move: each bake of Sim.grid is turned into one
+   world space triangle list, uploaded again only when the level changes */
+
+/* Rectangles whose center falls in one grid cell, stored contiguously */
+struct LevelCell {
+    float bounds[4]; // minX, minY, maxX, maxY of all its rectangles
+    int first, count; // vertex range
+};
+
+/* What the renderer needs of a bake. Every bake makes a new one, so a
+   snapshot still holding the previous level stays valid. */
+struct LevelGeometry {
+    vector<VertexP2C4> vertices; // GL_TRIANGLES, six per rectangle, grouped by cell
+    vector<LevelCell> cells;     // non-empty cells
+    int generation;              // of the bake
+};
+
+struct StaticLevel {
+    std::shared_ptr<const LevelGeometry> geometry; // of the last bake, simulation thread
+} Level;
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-    glVertexAttribPointer(
-                          0,                  // attribute 0. Vertices
-                          3,                  // size (x,y,z)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
-
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors
-    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-    glVertexAttribPointer(
-                          1,                  // attribute 1. Color
-                          3,                  // size (r,g,b)
-                          GL_FLOAT,           // type
-                          GL_FALSE,           // normalized?
-                          0,                  // stride
-                          (void*)0            // array buffer offset
-                          );
+/* Render thread side of the level */
+struct LevelMesh {
+    int uploaded;                // generation held by the mesh, 0 - none
+    MeshRef mesh;
+    vector<GLint> firsts;        // visible vertex ranges of the frame
+    vector<GLsizei> counts;
+} LevelDraw;
 
-    return vao;
+void bakeRectangle (vector<VertexP2C4> &out, double x, double y, double width, double height, const double color[3])
+{
+    VertexP2C4 v;
+    v.r = colorByte(color[0]); v.g = colorByte(color[1]); v.b = colorByte(color[2]); v.a = 255;
+    const double corners[6][2] = { {0,0}, {1,0}, {1,1}, {0,0}, {1,1}, {0,1} };
+    for (int i = 0; i < 6; i++) {
+      v.x = x + corners[i][0]*width;
+      v.y = y + corners[i][1]*height;
+      out.push_back(v);
+    }
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+/* Vertices of the grid's rectangles, sorted by the grid cell of their center */
+void bakeLevelGeometry (const LevelGrid &grid)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-    for (int i=0; i<numVertices; i++) {
-        color_buffer_data [3*i] = red;
-        color_buffer_data [3*i + 1] = green;
-        color_buffer_data [3*i + 2] = blue;
+    std::shared_ptr<LevelGeometry> geometry(new LevelGeometry());
+    geometry->generation = grid.generation;
+    Level.geometry = geometry;
+    int n = grid.rects.size(), columns = grid.columns, rows = grid.rows;
+    if (n == 0)
+      return;
+
+    // Counting sort of the rectangles by the cell of their center
+    vector<int> cellOf(n), start(columns*rows + 1, 0), order(n);
+    for (int i = 0; i < n; i++) {
+      const LevelRect &r = grid.rects[i];
+      int cx = (int) ((r.x + r.width/2 - grid.gridX)/LEVEL_CELL), cy = (int) ((r.y + r.height/2 - grid.gridY)/LEVEL_CELL);
+      cellOf[i] = min(cy, rows-1)*columns + min(cx, columns-1);
+      start[cellOf[i] + 1]++;
+    }
+    for (int c = 0; c < columns*rows; c++)
+      start[c+1] += start[c];
+    vector<int> fill(start.begin(), start.end() - 1);
+    for (int i = 0; i < n; i++)
+      order[fill[cellOf[i]]++] = i;
+
+    // Cells keep loose bounds: rectangles may stick out of their cell
+    for (int c = 0; c < columns*rows; c++) {
+      if (start[c] == start[c+1])
+        continue;
+      LevelCell cell = { { 1e30f, 1e30f, -1e30f, -1e30f }, (int) geometry->vertices.size(), 0 };
+      for (int k = start[c]; k < start[c+1]; k++) {
+        const LevelRect &r = grid.rects[order[k]];
+        bakeRectangle(geometry->vertices, r.x, r.y, r.width, r.height, r.color);
+        cell.bounds[0] = min(cell.bounds[0], (float) r.x);
+        cell.bounds[1] = min(cell.bounds[1], (float) r.y);
+        cell.bounds[2] = max(cell.bounds[2], (float) (r.x + r.width));
+        cell.bounds[3] = max(cell.bounds[3], (float) (r.y + r.height));
+      }
+      cell.count = geometry->vertices.size() - cell.first;
+      geometry->cells.push_back(cell);
     }
-
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+VAO* levelMesh (const LevelGeometry &g)
 {
-    // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
-
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
-
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
-
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
-
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    if (LevelDraw.uploaded != g.generation) {
+      VAO* vao = create3DObject(GL_TRIANGLES, g.vertices.size(), &g.vertices[0], GL_FILL);
+      setupInstancing(vao, Stream.Buffer);
+      LevelDraw.mesh = MeshRef(vao); // releases the previous level's buffers
+      LevelDraw.uploaded = g.generation;
+    }
+    return LevelDraw.mesh.get();
 }
 
+/* Unit mesh for a packet, created the first time it is drawn */
+VAO* queueMesh (int mesh, int line)
+{
+    if (mesh == MESH_LEVEL)
+      return levelMesh(*Queue.snapshot->geometry);
+    if (mesh == MESH_PARTICLES) {
+      MeshRef &ref = Queue.meshes[mesh][0];
+      if (!ref.get())
+        ref = MeshRef(createStreamObject<VertexP2C4S>(GL_POINTS));
+      return ref.get();
+    }
+    if (mesh == MESH_PREVIEW) {
+      MeshRef &ref = Queue.meshes[mesh][0];
+      if (!ref.get())
+        ref = MeshRef(createStreamObject<VertexP2C4>(GL_LINE_STRIP));
+      return ref.get();
+    }
+    if (mesh == MESH_TEXT) {
+      MeshRef &ref = Queue.meshes[mesh][0];
+      if (!ref.get())
+        ref = MeshRef(createStreamObject<VertexP2T2C4>(GL_TRIANGLES));
+      return ref.get();
+    }
 
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
+    MeshRef &ref = Queue.meshes[mesh][line];
+    if (!ref.get()) {
+      VAO* vao;
+      if (mesh == MESH_QUAD)
+        vao = createUnitSquare();
+      else if (mesh == MESH_CIRCLE_QUAD)
+        vao = createCircleQuad();
+      else
+        vao = createUnitCircle(LOD_MIN_SEGMENTS << (LOD_BUCKETS-1 - (mesh - MESH_CIRCLE_LOD)));
+      if (line)
+        vao->FillMode = GL_LINE;
+      setupInstancing(vao, Stream.Buffer);
+      ref = MeshRef(vao);
+    }
+    return ref.get();
+}
 
-/* Executed for character input (like in text boxes) */
-void keyboardChar (GLFWwindow* window, unsigned int key)
+void useQueueProgram (int program)
 {
-	switch (key) {
-		case 'Q':
-		case 'q':
-            quit(window);
-            break;
-		default:
-			break;
-	}
+    if (program == PROGRAM_BASIC) {
+      cachedUseProgram(programID);
+      return;
+    }
+    if (program == PROGRAM_TEXT) {
+      cachedUseProgram(TextShader.ID);
+      glUniform2f(TextShader.ScreenSizeID, Cam.width, Cam.height);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, Font.Texture);
+      return;
+    }
+    if (program == PROGRAM_PARTICLES) {
+      cachedUseProgram(ParticleShader.ID);
+      glUniform1f(ParticleShader.PointScaleID, Cam.height/(2*cameraHalfHeight()));
+      return;
+    }
+    cachedUseProgram(CircleShader.ID);
+    if (program == PROGRAM_RINGS) {
+      const Snapshot &s = *Queue.snapshot;
+      glUniform1i(CircleShader.RingCountID, s.ringCount);
+      glUniform1fv(CircleShader.RingRadiusID, s.ringCount, s.ringRadius);
+      glUniform3fv(CircleShader.RingColorID, s.ringCount, s.ringColor);
+    }
+    else
+      glUniform1i(CircleShader.RingCountID, 0);
 }
 
-/* Executed when a mouse button is pressed/released */
-
+struct CullBounds {
+    vector<float> minX, minY, maxX, maxY; // one entry per packet
+    vector<unsigned char> visible;
+} Bounds;
 
-GLfloat fov = 2.498f;
-/* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (GLFWwindow* window, int width, int height)
+bool overlaps (const float a[4], const float b[4])
 {
-    int fbwidth=width, fbheight=height;
-    /* With Retina display on Mac OS X, GLFW's FramebufferSize
-     is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
-
+    return a[0] <= b[2] && a[2] >= b[0] && a[1] <= b[3] && a[3] >= b[1];
+}
 
+/* Drop the packets whose instance lies outside the view. Packets with their
+   own transform and the level (culled per cell when drawn) always pass. */
+void cullRenderQueue ()
+{
+    float view[4];
+    cameraBounds(view);
+    int n = Queue.packets.size();
+    Bounds.minX.resize(n); Bounds.minY.resize(n); Bounds.maxX.resize(n); Bounds.maxY.resize(n);
+    Bounds.visible.resize(n);
+
+    for (int i = 0; i < n; i++) {
+      const DrawPacket &p = Queue.packets[i];
+      int mesh = (p.key >> 40) & 0xffff, slot = (p.key >> 23) & 0xffff;
+      const InstanceData &d = p.instance;
+      if (slot != 0 || mesh >= MESH_LEVEL) {
+        Bounds.minX[i] = Bounds.minY[i] = -1e30f;
+        Bounds.maxX[i] = Bounds.maxY[i] = 1e30f;
+      }
+      else if (mesh == MESH_QUAD) { // [0, 1] square
+        Bounds.minX[i] = d.offset[0]; Bounds.maxX[i] = d.offset[0] + d.scale[0];
+        Bounds.minY[i] = d.offset[1]; Bounds.maxY[i] = d.offset[1] + d.scale[1];
+      }
+      else { // circles, [-1, 1]
+        Bounds.minX[i] = d.offset[0] - d.scale[0]; Bounds.maxX[i] = d.offset[0] + d.scale[0];
+        Bounds.minY[i] = d.offset[1] - d.scale[1]; Bounds.maxY[i] = d.offset[1] + d.scale[1];
+      }
+    }
 
-	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+    int i = 0;
+#ifdef __SSE__
+    // Four bounds per test
+    __m128 viewMinX = _mm_set1_ps(view[0]), viewMinY = _mm_set1_ps(view[1]);
+    __m128 viewMaxX = _mm_set1_ps(view[2]), viewMaxY = _mm_set1_ps(view[3]);
+    for (; i + 4 <= n; i += 4) {
+      __m128 outside = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(_mm_loadu_ps(&Bounds.maxX[i]), viewMinX),
+                                           _mm_cmpgt_ps(_mm_loadu_ps(&Bounds.minX[i]), viewMaxX)),
+                                 _mm_or_ps(_mm_cmplt_ps(_mm_loadu_ps(&Bounds.maxY[i]), viewMinY),
+                                           _mm_cmpgt_ps(_mm_loadu_ps(&Bounds.minY[i]), viewMaxY)));
+      int mask = _mm_movemask_ps(outside);
+      for (int k = 0; k < 4; k++)
+        Bounds.visible[i+k] = !((mask >> k) & 1);
+    }
+#endif
+    for (; i < n; i++)
+      Bounds.visible[i] = !(Bounds.maxX[i] < view[0] || Bounds.minX[i] > view[2] ||
+                            Bounds.maxY[i] < view[1] || Bounds.minY[i] > view[3]);
+
+    int kept = 0;
+    for (i = 0; i < n; i++)
+      if (Bounds.visible[i])
+        Queue.packets[kept++] = Queue.packets[i];
+    Queue.packets.resize(kept);
+    Culling.visibleObjects = kept;
+    Culling.culledObjects = n - kept;
+}
 
-	// set the projection matrix as perspective
-	/* glMatrixMode (GL_PROJECTION);
-	   glLoadIdentity ();
-	   gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
-	// Store the projection matrix in a variable for future use
-    // Perspective projection for 3D views
-    //ov=1.0f;
-     Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
+/* Draw the level cells in view, adjacent cells merged into one range */
+void drawLevel (VAO* vao)
+{
+    const LevelGeometry &g = *Queue.snapshot->geometry;
+    float view[4];
+    cameraBounds(view);
+    LevelDraw.firsts.clear();
+    LevelDraw.counts.clear();
+    for (size_t c = 0; c < g.cells.size(); c++) {
+      const LevelCell &cell = g.cells[c];
+      if (!overlaps(cell.bounds, view))
+        continue;
+      if (!LevelDraw.firsts.empty() && LevelDraw.firsts.back() + LevelDraw.counts.back() == cell.first)
+        LevelDraw.counts.back() += cell.count;
+      else {
+        LevelDraw.firsts.push_back(cell.first);
+        LevelDraw.counts.push_back(cell.count);
+      }
+      Culling.visibleCells++;
+    }
+    Culling.culledCells = g.cells.size() - Culling.visibleCells;
+    if (LevelDraw.firsts.empty())
+      return;
+
+    cachedPolygonMode (vao->FillMode);
+    cachedBindVertexArray (vao->VertexArrayID);
+    glMultiDrawArrays(vao->PrimitiveMode, &LevelDraw.firsts[0], &LevelDraw.counts[0], LevelDraw.firsts.size());
+    resetInstanceAttributes();
+}
 
-    // Ortho projection for 2D views
-    //Matrices.projection = glm::ortho(-16.0f, 16.0f, -9.0f, 9.0f, 0.1f, 500.0f);
+/* Particles : debris and smoke, simulated on the CPU in a fixed pool laid out
+   as a structure of arrays, [0, count) alive. They follow the same gravity and
+   airResistance model as the objects; 'weight' scales gravity, negative for
+   rising smoke. Spawning past the capacity is ignored, dying swaps in the last
+   particle, so the frame path never allocates. */
+#define PARTICLE_CAPACITY 131072 // multiple of 8
+#define PARTICLE_DEBRIS 0
+#define PARTICLE_SMOKE 1
+
+struct ParticlePool {
+    float *x, *y, *xVel, *yVel, *weight, *life, *lifeSpan, *size; // 32 byte aligned
+    GLubyte (*color)[3];
+    int count;
+    uint32_t seed;
+    int useAVX2;
+} Particles;
+
+float* allocParticleArray ()
+{
+    void* p = NULL;
+    if (posix_memalign(&p, 32, PARTICLE_CAPACITY*sizeof(float)) != 0)
+      exit(EXIT_FAILURE);
+    return (float*) p;
 }
 
-VAO *triangle, *rectangle, *circle;
+void initParticles ()
+{
+    Particles.x = allocParticleArray(); Particles.y = allocParticleArray();
+    Particles.xVel = allocParticleArray(); Particles.yVel = allocParticleArray();
+    Particles.weight = allocParticleArray(); Particles.life = allocParticleArray();
+    Particles.lifeSpan = allocParticleArray(); Particles.size = allocParticleArray();
+    Particles.color = new GLubyte[PARTICLE_CAPACITY][3];
+    Particles.count = 0;
+    Particles.seed = 2463534242u;
+#ifdef HAVE_AVX2_DISPATCH
+    Particles.useAVX2 = __builtin_cpu_supports("avx2");
+#else
+    Particles.useAVX2 = 0;
+#endif
+}
 
-// Creates the triangle object used in this sample code
-void createTriangle ()
+/* Uniform in [0, 1), xorshift */
+float particleRandom ()
 {
-  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+    uint32_t s = Particles.seed;
+    s ^= s << 13; s ^= s >> 17; s ^= s << 5;
+    Particles.seed = s;
+    return (s >> 8) * (1.0f/16777216);
+}
 
-  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-  static const GLfloat vertex_buffer_data [] = {
-    0, 1,0, // vertex 0
-    -1,-1,0, // vertex 1
-    1,-1,0, // vertex 2
-  };
+/* n particles around (x, y), moving along (xVel, yVel) give or take 'spread' */
+void spawnParticles (int kind, double x, double y, double xVel, double yVel, double spread, int n, const double color[3])
+{
+    n = min(n, PARTICLE_CAPACITY - Particles.count);
+    for (int k = 0; k < n; k++) {
+      int i = Particles.count++;
+      float angle = 2*M_PI*particleRandom(), speed = spread*particleRandom();
+      Particles.x[i] = x; Particles.y[i] = y;
+      Particles.xVel[i] = xVel + speed*cos(angle);
+      Particles.yVel[i] = yVel + speed*sin(angle);
+      if (kind == PARTICLE_DEBRIS) {
+        Particles.weight[i] = 1;
+        Particles.size[i] = 0.05 + 0.05*particleRandom();
+        Particles.lifeSpan[i] = 40 + 40*particleRandom();
+      }
+      else {
+        Particles.weight[i] = -0.1;
+        Particles.size[i] = 0.2 + 0.2*particleRandom();
+        Particles.lifeSpan[i] = 30 + 30*particleRandom();
+      }
+      Particles.life[i] = Particles.lifeSpan[i];
+      float shade = kind == PARTICLE_SMOKE ? 0.5 + 0.3*particleRandom() : 0.8 + 0.2*particleRandom();
+      for (int c = 0; c < 3; c++)
+        Particles.color[i][c] = colorByte(kind == PARTICLE_SMOKE ? shade : color[c]*shade);
+    }
+}
 
-  static const GLfloat color_buffer_data [] = {
-    1,0,0, // color 0
-    0,1,0, // color 1
-    0,0,1, // color 2
-  };
+/* One step of [first, last): gravity, motion, air resistance and aging */
+void integrateParticles (int first, int last)
+{
+    for (int i = first; i < last; i++) {
+      Particles.yVel[i] -= gravity*Particles.weight[i];
+      Particles.x[i] += Particles.xVel[i];
+      Particles.y[i] += Particles.yVel[i];
+      Particles.xVel[i] *= airResistance;
+      Particles.yVel[i] *= airResistance;
+      Particles.life[i] -= 1;
+    }
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+#ifdef HAVE_AVX2_DISPATCH
+/* Same step, eight particles at a time; 'last' - 'first' must be a multiple of 8 */
+__attribute__ ((target ("avx2")))
+void integrateParticlesAVX2 (int first, int last)
+{
+    const __m256 g = _mm256_set1_ps(gravity), air = _mm256_set1_ps(airResistance), one = _mm256_set1_ps(1);
+    for (int i = first; i < last; i += 8) {
+      __m256 xVel = _mm256_load_ps(Particles.xVel + i);
+      __m256 yVel = _mm256_sub_ps(_mm256_load_ps(Particles.yVel + i), _mm256_mul_ps(g, _mm256_load_ps(Particles.weight + i)));
+      _mm256_store_ps(Particles.x + i, _mm256_add_ps(_mm256_load_ps(Particles.x + i), xVel));
+      _mm256_store_ps(Particles.y + i, _mm256_add_ps(_mm256_load_ps(Particles.y + i), yVel));
+      _mm256_store_ps(Particles.xVel + i, _mm256_mul_ps(xVel, air));
+      _mm256_store_ps(Particles.yVel + i, _mm256_mul_ps(yVel, air));
+      _mm256_store_ps(Particles.life + i, _mm256_sub_ps(_mm256_load_ps(Particles.life + i), one));
+    }
 }
+#endif
 
+void moveParticle (int to, int from)
+{
+    Particles.x[to] = Particles.x[from]; Particles.y[to] = Particles.y[from];
+    Particles.xVel[to] = Particles.xVel[from]; Particles.yVel[to] = Particles.yVel[from];
+    Particles.weight[to] = Particles.weight[from]; Particles.life[to] = Particles.life[from];
+    Particles.lifeSpan[to] = Particles.lifeSpan[from]; Particles.size[to] = Particles.size[from];
+    memcpy(Particles.color[to], Particles.color[from], 3);
+}
 
-VAO* createCircle(float r, float col1 = 1, float col2 = 0.843, float col3 = 0)
-  {
-    float rad = r;
-    //GLfloat vertex_buffer_data[3*3] = {1, 1, 0, -1, 1, 0, -1, -1, 0,};
-    GLfloat vertex_buffer_data[3*1000]; // = {1, 1, 0, -1, 1, 0, -1, -1, 0,};
-    int i;
-    for(i=0; i<1000; i+=3){
-      if(i%6==3){
-        vertex_buffer_data[i] = 0;
-        vertex_buffer_data[i+1] = 0;
-        vertex_buffer_data[i+2] = 0;
-        continue;
-      }
-      vertex_buffer_data[i] = rad*sin(2.0*3.141592*i/100);
-      vertex_buffer_data[i+1] = rad*cos(2.0*3.141592*i/100);
-      vertex_buffer_data[i+2] = 0;
+void updateParticles ()
+{
+    int n = Particles.count, simd = 0;
+#ifdef HAVE_AVX2_DISPATCH
+    if (Particles.useAVX2) {
+      simd = n & ~7;
+      integrateParticlesAVX2(0, simd);
     }
+#endif
+    integrateParticles(simd, n);
+
+    for (int i = 0; i < Particles.count; )
+      if (Particles.life[i] <= 0)
+        moveParticle(i, --Particles.count);
+      else
+        i++;
+}
 
-     GLfloat color_buffer_data [3*1000];
-     for(i=0; i<1000; i+=3){
-      color_buffer_data[i] = col1;
-      color_buffer_data[i+1] = col2;
-      color_buffer_data[i+2] = col3;
+/* Every live particle as one point sprite */
+void snapshotParticles (vector<VertexP2C4S> &v)
+{
+    int n = Particles.count;
+    v.resize(n);
+    for (int i = 0; i < n; i++) {
+      v[i].x = Particles.x[i]; v[i].y = Particles.y[i];
+      v[i].r = Particles.color[i][0]; v[i].g = Particles.color[i][1]; v[i].b = Particles.color[i][2];
+      v[i].a = colorByte(Particles.life[i]/Particles.lifeSpan[i]);
+      v[i].size = Particles.size[i];
     }
+}
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    return create3DObject(GL_TRIANGLES, 300, vertex_buffer_data, color_buffer_data, GL_FILL);
-  }
-//Create a rectangle object
-VAO* createRectangle ( float width1, float height1)
-{
-  // GL3 accepts only Triangles. Quads are not supported
-  VAO *recta;
-  float x = 0; float y = 0; float width = width1; float height = height1;
-  GLfloat vertex_buffer_data [] = {
-    x,y,0, // vertex 1
-    x,y+height,0, // vertex 2
-    x+width, y+height,0, // vertex 3
-
-    x+width, y+height,0, // vertex 3
-    x+width, y,0, // vertex 4
-    x,y,0  // vertex 1
-  };
+/* The snapshot's point sprites, copied into the stream */
+void drawParticles (VAO* vao)
+{
+    const vector<VertexP2C4S> &sprites = Queue.snapshot->particles;
+    int n = sprites.size();
+    if (n == 0)
+      return;
+    size_t base;
+    memcpy(mapStream(n*sizeof(VertexP2C4S), base), &sprites[0], n*sizeof(VertexP2C4S));
+    unmapStream();
+
+    pointVertices<VertexP2C4S>(vao, Stream.Buffer, base);
+    glDrawArrays(GL_POINTS, 0, n);
+}
 
-  GLfloat color_buffer_data [] = {
-    1,0,0, // color 1
-    1,0,0, // color 2
-    1,0,0, // color 3
+/* Trajectory preview : where a shot at the current aim would go, as one point
+   per simulated frame. The path is kept while the aim moved too little to
+   shift it by more than PREVIEW_TOLERANCE, and recomputed from scratch when the
+   level changed. Otherwise the steps before the old path's first bounce that
+   stay within the tolerance are only integrated, the level collisions run
+   from there on. */
+#define PREVIEW_STEPS 240
+#define PREVIEW_TOLERANCE 1.0 // on-screen pixels, anywhere along the path
+
+struct TrajectoryPreview {
+    vector<float> path;   // x, y per step, capacity for PREVIEW_STEPS + 1 points
+    vector<int> nearby;   // broad phase results, reused every step
+    double xVel, yVel;    // aim the path was computed for
+    int generation;       // level it was computed against
+    int firstBounce;      // first step that hit the level, PREVIEW_STEPS if none did
+    std::atomic<long> computed, resumed, reused; // read by the main thread
+    std::atomic<long> collided; // steps run with collision checks
+} Preview;
+
+void printPreviewStats ()
+{
+    cout << "Trajectory preview: " << Preview.computed << " paths computed, " << Preview.resumed << " resumed, "
+         << Preview.reused << " reused, " << Preview.collided << " steps collided" << endl;
+}
 
-    1,0,0, // color 3
-    1,0,0, // color 4
-    1,0,0  // color 1
-  };
+void drawPreview (VAO* vao, const GLfloat color[3])
+{
+    const vector<float> &path = Queue.snapshot->path;
+    int n = path.size()/2;
+    if (n < 2)
+      return;
+    size_t base;
+    VertexP2C4* v = (VertexP2C4*) mapStream(n*sizeof(VertexP2C4), base);
+    for (int i = 0; i < n; i++) {
+      v[i].x = path[2*i]; v[i].y = path[2*i+1];
+      v[i].r = colorByte(color[0]); v[i].g = colorByte(color[1]); v[i].b = colorByte(color[2]); v[i].a = 255;
+    }
+    unmapStream();
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  recta = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-  return recta;
+    // Instance attributes stay disabled, their constants leave the path in world space
+    pointVertices<VertexP2C4>(vao, Stream.Buffer, base);
+    cachedPolygonMode (vao->FillMode);
+    glDrawArrays(GL_LINE_STRIP, 0, n);
 }
 
+/* Sort the frame's packets, upload all their instances at once and draw them.
+   The transforms they refer to must already be uploaded. */
+void submitRenderQueue ()
+{
+    Queue.draws = 0;
+    Culling.visibleCells = Culling.culledCells = 0;
+    cullRenderQueue();
+    int n = Queue.packets.size();
+    if (n == 0)
+      return;
+
+    sortRenderQueue();
+
+    // All the frame streams, reserved before any draw: the instances, then what
+    // drawText, drawParticles and drawPreview map in the middle of the loop
+    const Snapshot &s = *Queue.snapshot;
+    reserveStream(streamBytes(n*sizeof(InstanceData)) + streamBytes(Text.vertices.size()*sizeof(VertexP2T2C4))
+                  + streamBytes(s.particles.size()*sizeof(VertexP2C4S)) + streamBytes(s.path.size()/2*sizeof(VertexP2C4)));
+
+    // One streamed write for every instance of the frame, in submission order
+    size_t base;
+    InstanceData* instances = (InstanceData*) mapStream(n*sizeof(InstanceData), base);
+    for (int i = 0; i < n; i++)
+      instances[i] = Queue.packets[i].instance;
+    unmapStream();
+
+    int lastProgram = -1;
+    for (int first = 0; first < n; ) {
+      uint64_t key = Queue.packets[first].key;
+      int last = first + 1;
+      while (last < n && Queue.packets[last].key == key)
+        last++;
+
+      int program = (key >> 56) & 0xf;
+      int mesh = (key >> 40) & 0xffff;
+      int line = (key >> 39) & 1;
+      int slot = (key >> 23) & 0xffff;
+
+      gpuScope(mesh == MESH_LEVEL ? GPU_STATIC : mesh == MESH_TEXT ? GPU_HUD : GPU_DYNAMIC);
+      if (program != lastProgram) {
+        useQueueProgram(program);
+        lastProgram = program;
+      }
+      bindTransform(slot);
+      VAO* vao = queueMesh(mesh, line);
+      pointInstances(vao, Stream.Buffer, base + first*sizeof(InstanceData));
+      if (mesh == MESH_LEVEL)
+        drawLevel(vao); // one instance, the level is in world space
+      else if (mesh == MESH_PARTICLES)
+        drawParticles(vao);
+      else if (mesh == MESH_PREVIEW)
+        drawPreview(vao, Queue.packets[first].instance.color);
+      else if (mesh == MESH_TEXT)
+        drawText(vao);
+      else
+        draw3DObjectInstanced(vao, last - first);
+      Queue.draws++;
+      first = last;
+    }
+    Queue.packets.clear();
+}
 
-glm::mat4 MVP;
-glm::mat4 VP;
-
-float camera_rotation_angle = 90;
-float rectangle_rotation = 0;
-float triangle_rotation = 0;
-float translateX = 0;
-float translateY = 0;
 
 //Map class, updates happen here
 class map{
   public:
-    vector<VAO*> arr_rec;
-    VAO* gun; float gunRotation;
+    float gunRotation;
     void mapInit(){
-      gun = createRectangle( 2, 1 ); gunRotation = 0;
+      gunRotation = 0;
     }
     void update(){
-      for(int i=0; i < arr_rec.size(); i++) { //rectangle
-        Matrices.model = glm::mat4(1.0f);
-        // Get mouse position
-        //xpos*8/1080, ypos*8/1080
-
-        glm::mat4 translateRectangle = glm::translate (glm::vec3(0, 0, 0));
-        //cout<<xpos<<" "<<ypos<<endl;
-        //cout<<(xpos-500)*8/1000<<" "<<(-ypos+500)*8/1000<<endl;
-
-        Matrices.model *= translateRectangle;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(arr_rec[i]);
-      }
-      Matrices.model = glm::mat4(1.0f);
+      glm::mat4 model(1.0f);
 
       //Rotate about -3, -3
       glm::mat4 translateGun = glm::translate (glm::vec3(-14, -7, 0));        // glTranslatef
-      float gunRotationAngle = atan2((yposNew+7),(xposNew+14)); //cout<<"Rot angle: "<<(yposNew+14)/(xposNew+7)<<endl;
+      float gunRotationAngle = atan2((aimY+7),(aimX+14)); //cout<<"Rot angle: "<<(yposNew+14)/(xposNew+7)<<endl;
       glm::mat4 rotateGun = glm::rotate((float)(gunRotationAngle), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
       glm::mat4 translateAgain =  glm::translate (glm::vec3(+14, +7, 0));        // glTranslatef
 
-      //Translate to where it was
-      glm::mat4 translateAgain1 =  glm::translate (glm::vec3(-14+1.3/2, -7.5, 0));        // glTranslatef
+      model *= (translateGun * rotateGun * translateAgain);
 
-      Matrices.model *= (translateGun * rotateGun * translateAgain * translateAgain1);
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);;
+      //Translate to where it was: the unit quad placed and sized as the 2x1 barrel
+      static const double red[3] = {1, 0, 0};
+      pushDraw(LAYER_GUN, PROGRAM_BASIC, MESH_QUAD, GL_FILL, emitTransform(model),
+               makeInstance(-14+1.3/2, -7.5, 2, 1, red));
       gunRotation++;
-      draw3DObject(gun);
     }
-}World;
-
+}Scene;
 
-class obj{
-public:
-  int is_circle, isPhysics;
-  double xPos, yPos, width, height, radius;
-  double xVel, yVel, xAcc, yAcc;
-  VAO* toDraw;
-
-  void objInit(double xPosNew,double yPosNew, double widthNew, double heightNew){
-    xPos = xPosNew; yPos = yPosNew;
-    width = widthNew; height = heightNew;
-    toDraw = createRectangle(width, height);
-  }
-  void objInit(double xPosNew,double yPosNew,double radiusNew){
-    xPos = xPosNew; yPos = yPosNew; radius = radiusNew;
-    toDraw = createCircle(radius); isPhysics = 0;
-    update();
-  }
-  void setColor(double col1, double col2, double col3){
-    toDraw = createCircle(radius, col1, col2, col3);
-    update();
-  }
-  void reset(double xPosNew, double yPosNew){
-    xPos = xPosNew; yPos = yPosNew;
-    xVel = yVel = xAcc = yAcc = 0;
-    update();
-  }
-  void update(){
-    //if(radius!=0.1)checkCollision(xPos, yPos, width, height);
-    xVel += xAcc; yVel += yAcc;
-    xPos += xVel; yPos += yVel;
-    //if(xVel > 0.4)xVel=0.4; if(yVel>0.4)yVel=0.4;
-    if(isPhysics==1) updatePhysics();
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 translate = glm::translate (glm::vec3(xPos, yPos, 0));        // glTranslatef
-    glm::mat4 rotate = glm::rotate((float)(0), glm::vec3(0,0,1));
-    Matrices.model *= (translate * rotate);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);;
-    draw3DObject(toDraw);
-  }
-  void updatePhysics(){
-    xVel *= airResistance; yVel *= airResistance;
-    yAcc = -gravity;
-  }
 
-}cannonball, cannon, targetA, targetInner[4], wall[4], platform[10], obstacle[10];
+//Particles are drawn last, over everything else
+void emitParticles(){
+  static const double white[3] = {1, 1, 1};
+  if(!Particles.count)return;
+  snapshotParticles(Frame->particles);
+  pushDraw(LAYER_PARTICLES, PROGRAM_PARTICLES, MESH_PARTICLES, GL_FILL, 0, makeInstance(0, 0, 1, 1, white));
+}
 
+//Describe an object to the snapshot; lodRadius picks the circle mesh if set
+void emitObject(const obj &o, int layer, double lodRadius = 0){
+  if(!o.is_circle)
+    pushMovingDraw(layer, PROGRAM_BASIC, MESH_QUAD, GL_FILL, makeInstance(o.xPos, o.yPos, o.width, o.height, o.color), o.xPrev, o.yPrev);
+  else if(circleMode == CIRCLE_SDF)
+    pushMovingDraw(layer, PROGRAM_CIRCLE, MESH_CIRCLE_QUAD, GL_FILL, makeInstance(o.xPos, o.yPos, o.radius, o.radius, o.color), o.xPrev, o.yPrev);
+  else
+    pushMovingDraw(layer, PROGRAM_BASIC, circleMesh(lodRadius ? lodRadius : o.radius), circleMode == CIRCLE_OUTLINE ? GL_LINE : GL_FILL,
+                   makeInstance(o.xPos, o.yPos, o.radius, o.radius, o.color), o.xPrev, o.yPrev);
+}
 
+//The whole level in a single draw, baked again after every level change
+void emitLevel(){
+  static const double white[3] = {1, 1, 1};
+  if(!Level.geometry || Level.geometry->generation != Sim.grid.generation)bakeLevelGeometry(Sim.grid);
+  if(Level.geometry->vertices.empty())return;
+  Frame->geometry = Level.geometry;
+  pushDraw(LAYER_LEVEL, PROGRAM_BASIC, MESH_LEVEL, GL_FILL, 0, makeInstance(0, 0, 1, 1, white));
+}
 
-void checkCollision(obj &A, obj &B){ //B is a circle, A is a rectangle
-  double xRect = A.xPos; double yRect = A.yPos; double width = A.width; double height = A.height;
-  double x = B.xPos; double y = B.yPos; double yVel = B.yVel; double xVel = B.xVel;
-  //cout<<x<<" "<<y<<" "<<yVel<<" "<<xVel<<endl;
-  if(x > xRect && x < xRect+width && y > yRect+height && y+yVel-B.radius<yRect+height){
-    B.yPos=yRect+height+B.radius;
-    //cout<<B.yPos<<" "<<cannonball.yPos<<endl;
-    B.yVel*=-0.9;
-    B.xVel*=0.98;
+//Draw targetA and the targetInner discs as concentric rings of one circle
+void emitTargetRings(){
+  const obj &targetA = Sim.targetA, *targetInner = Sim.targetInner;
+  Frame->ringCount = 5;
+  Frame->ringRadius[0] = 1;
+  for(int c=0; c<3; c++)Frame->ringColor[c] = targetA.color[c];
+  for(int i=0; i<4; i++){
+    Frame->ringRadius[i+1] = targetInner[i].radius/targetA.radius;
+    for(int c=0; c<3; c++)Frame->ringColor[3*(i+1)+c] = targetInner[i].color[c];
   }
-  else if(x > xRect && x < xRect+width && y < yRect&& y+yVel+B.radius>yRect){
-    B.yPos=yRect-B.radius;
-    B.yVel*=-0.9;
-  }
-  else if(y > yRect && y < yRect+height && x > xRect+width && x+xVel-B.radius<xRect+width){
-    B.xPos = xRect+width+B.radius;
-    B.xVel*=-1;
+  pushMovingDraw(LAYER_TARGET, PROGRAM_RINGS, MESH_CIRCLE_QUAD, GL_FILL,
+                 makeInstance(targetA.xPos, targetA.yPos, targetA.radius, targetA.radius, targetA.color), targetA.xPrev, targetA.yPrev);
+}
+
+//Run the ball's own integrator from the cannon against the static level
+void updatePreview(double xVel, double yVel){
+  // Without bounces, two aims drift apart by at most |dv| per step
+  double dv = fabs(xVel - Preview.xVel) + fabs(yVel - Preview.yVel);
+  double tolerance = PREVIEW_TOLERANCE/lodPixelsPerUnit;
+  int keep = 0; // leading steps that skip the level collisions
+  if(Preview.generation == Sim.grid.generation){
+    if(dv*PREVIEW_STEPS < tolerance){
+      Preview.reused++;
+      return;
+    }
+    keep = min(Preview.firstBounce, (int) (tolerance/dv));
   }
-  else if(y > yRect && y < yRect+height && x < xRect && x+xVel+B.radius>xRect){
-    B.xPos = xRect-B.radius;
-    B.xVel*=-1;
+  Preview.xVel = xVel; Preview.yVel = yVel;
+  Preview.generation = Sim.grid.generation;
+  Preview.firstBounce = PREVIEW_STEPS;
+  if(keep > 0)Preview.resumed++;
+  else Preview.computed++;
+
+  if(Preview.path.capacity() == 0)Preview.path.reserve(2*(PREVIEW_STEPS + 1));
+  Preview.path.clear();
+
+  obj ball = Sim.cannonball;
+  ball.isPhysics = 1; //as fire() does
+  ball.reset(Sim.canX, Sim.canY);
+  ball.xVel = xVel; ball.yVel = yVel;
+  Preview.path.push_back(ball.xPos); Preview.path.push_back(ball.yPos);
+  for(int step=0; step<PREVIEW_STEPS; step++){
+    // Same order as step(): collide, then move
+    if(step >= keep){
+      float box[4] = { (float) (ball.xPos - ball.radius - fabs(ball.xVel)), (float) (ball.yPos - ball.radius - fabs(ball.yVel)),
+                       (float) (ball.xPos + ball.radius + fabs(ball.xVel)), (float) (ball.yPos + ball.radius + fabs(ball.yVel)) };
+      levelRectsNear(Sim.grid, box, Preview.nearby);
+      for(size_t k=0; k<Preview.nearby.size(); k++)
+        if(checkCollision(levelObj(Sim, Preview.nearby[k]), ball))Preview.firstBounce = min(Preview.firstBounce, step);
+      Preview.collided++;
+    }
+    ball.update();
+    Preview.path.push_back(ball.xPos); Preview.path.push_back(ball.yPos);
+    if(fabs(ball.xPos) > 100 || fabs(ball.yPos) > 100)break; //left the level
   }
 }
 
-int checkCollisionCircle(obj &firstBall, obj &secondBall){ //Circle //For now, B is target
-  if (firstBall.xPos + firstBall.radius + secondBall.radius > secondBall.xPos
-    && firstBall.xPos < secondBall.xPos + firstBall.radius + secondBall.radius
-    && firstBall.yPos + firstBall.radius + secondBall.radius > secondBall.yPos
-    && firstBall.yPos < secondBall.yPos + firstBall.radius + secondBall.radius)
-  {
-    //AABBs are overlapping
-    if(secondBall.xVel < firstBall.xVel)
-    secondBall.xVel += firstBall.xVel*0.5, firstBall.xVel /= 2;
-    else
-    firstBall.xVel += secondBall.xVel*0.5, secondBall.xVel /= 2;
+//The predicted path, one streamed line strip
+void emitPreview(){
+  static const double aim[3] = {0.4, 0.4, 0.55};
+  updatePreview((aimX-Sim.canX)/20, (aimY-Sim.canY)/20);
+  Frame->path = Preview.path;
+  pushDraw(LAYER_PREVIEW, PROGRAM_BASIC, MESH_PREVIEW, GL_FILL, 0, makeInstance(0, 0, 1, 1, aim));
+}
 
-    if(secondBall.yVel < firstBall.yVel)
-    secondBall.yVel += firstBall.yVel*0.5, firstBall.yVel /= 2;
-    else
-    firstBall.yVel += secondBall.yVel*0.5, secondBall.yVel/=2;
-    return 1;
-  }
-  return 0;
-}
-
-void makewalls(){
-  wall[0].objInit(-16, -9, 32, 0.2);
-  wall[1].objInit(-16, -9, 0.2, 18);
-  wall[2].objInit(-16, 8.8, 32, 0.2);
-  wall[3].objInit(15.8, -9, 0.2, 18);
-  for(int i=0; i<platformNumber; i++){
-    //cout<<platformData[i]<<endl;
-    platform[i].objInit(platformData[4*i], platformData[4*i+1], platformData[4*i+2], platformData[4*i+3]);
-    //if(i==1)platform[i].yVel=0.02;
-  }
-  for(int i=0; i<4; i++)wall[i].update();
-  for(int i=0; i<platformNumber; i++)platform[i].update();
+//Debris off whatever the ball hit, more for harder hits
+void spawnImpact(const WorldEvent &e){
+  double speed = sqrt(e.xVel*e.xVel + e.yVel*e.yVel);
+  if(speed < 0.05)return; //rolling
+  spawnParticles(PARTICLE_DEBRIS, e.x, e.y, e.xVel/2, e.yVel/2, speed/2, min(400, (int) (speed*1000)), e.color);
+}
+
+//Muzzle smoke and sparks when the cannon fires
+void spawnMuzzle(const WorldEvent &e){
+  static const double spark[3] = {1, 0.6, 0.1};
+  spawnParticles(PARTICLE_SMOKE, e.x, e.y, e.xVel/4, e.yVel/4, 0.05, 300, spark);
+  spawnParticles(PARTICLE_DEBRIS, e.x, e.y, e.xVel/2, e.yVel/2, 0.1, 200, spark);
+}
+
+/* Executed when a regular key is pressed/released/held-down */
+/* Prefered for Keyboard events */
+
+/* Executed for character input (like in text boxes) */
+void keyboardChar (GLFWwindow* window, unsigned int key)
+{
+	switch (key) {
+		case 'Q':
+		case 'q':
+            quit(window);
+            break;
+		case 'M':
+		case 'm':
+            printMeshStats();
+            printStreamStats();
+            printCaptureStats();
+            break;
+		case 'G':
+		case 'g':
+            printGLStateStats();
+            break;
+		case 'P':
+		case 'p':
+            printGPUProfile();
+            break;
+		case 'C':
+		case 'c':
+            pushInput(INPUT_CIRCLE_MODE);
+            break;
+		case 'H':
+		case 'h':
+            showHUD = !showHUD;
+            break;
+		case 'U':
+		case 'u':
+            printCullStats();
+            printPreviewStats();
+            break;
+		case 'V':
+		case 'v':
+            toggleCameraProjection();
+            break;
+		case 'F':
+		case 'f': {
+            static const double caps[] = { 0, 30, 60, 100, 144 }; // cycled in this order
+            int i = 0;
+            while (i < 5 && caps[i] != Scheduler.cap) i++;
+            setFrameCap(caps[(i + 1) % 5]);
+            printScheduler();
+            break;
+        }
+		case 'T':
+		case 't':
+            printFramePacing();
+            break;
+		case 'Y':
+		case 'y':
+            setSwapInterval(Scheduler.swapInterval == 1 ? 0 : Scheduler.swapInterval == 0 ? -1 : 1); // on -> off -> adaptive
+            printScheduler();
+            break;
+		default:
+			break;
+	}
 }
 
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -526,10 +3023,7 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
   if (action == GLFW_RELEASE) {
     switch (key) {
       case GLFW_KEY_SPACE:
-        cannonball.isPhysics = 1;
-        double a = sqrt((xposNew-canX)*(xposNew-canX) + (yposNew-canY)*(yposNew-canY));
-        cannonball.reset(canX + (xposNew-canX)*0/a , canY + (yposNew-canY)*0/a);
-        cannonball.xVel = (xposNew-canX)*1/20 ; cannonball.yVel = (yposNew-canY)*1/20;
+        pushInput(INPUT_FIRE);
       break;
     }
   }
@@ -544,29 +3038,11 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
   }
 }
 
-void levelGen(){
-  ifstream fin;
-  levelString[0] = char(level)+'0';
-  //cout<<levelString<<endl;
-  fin.open(levelString);
-  fin>>platformNumber; //cout<<platformNumber;
-  for(int i=0; i<4*platformNumber; i++)fin>>platformData[i];
-  fin>>targetX;
-  fin>>targetY;
-  makewalls();
-
-  targetA.objInit(targetX, targetY, 0.8); targetA.reset(targetX, targetY);
-  targetInner[0].objInit(targetX, targetY, 0.6); targetInner[0].setColor(1, 1, 0.878);
-  targetInner[1].objInit(targetX, targetY, 0.5); targetInner[1].setColor(0.275, 0.510, 0.706);
-  targetInner[2].objInit(targetX, targetY, 0.4); targetInner[2].setColor(0.902, 0.902, 0.980);
-  targetInner[3].objInit(targetX, targetY, 0.3); targetInner[3].setColor(0.863, 0.078, 0.235);
-
-}
-float panX=0, panY=0; int panState=0;
+int panState=0;
 
 //Divanshu, set keyboard controls as specified in the requirements.
 //Press alt+~ to get to the other atom tab, I have 1.txt and 2.txt, levels - Modify and add more x.txt's.
-//NUMBER_OF_LEVELS - #Defined. Change to modify the number of levels.
+//NUMBER_OF_LEVELS - in simulation.h. Change to modify the number of levels.
 
 void mouseButton (GLFWwindow* window, int button, int action, int mods)
 {
@@ -574,10 +3050,7 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
         case GLFW_MOUSE_BUTTON_LEFT:
 
             if (action == GLFW_RELEASE){
-                cannonball.isPhysics = 1;
-                double a = sqrt((xposNew-canX)*(xposNew-canX) + (yposNew-canY)*(yposNew-canY));
-                cannonball.reset(canX + (xposNew-canX)*0/a , canY + (yposNew-canY)*0/a);
-                cannonball.xVel = (xposNew-canX)*1/20 ; cannonball.yVel = (yposNew-canY)*1/20;
+                pushInput(INPUT_FIRE);
               }
             break;
         case GLFW_MOUSE_BUTTON_RIGHT:
@@ -591,8 +3064,152 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
-  fov -= yoffset/200;
-  if(fov>2.498f)fov=2.498f;
+  zoomCamera(Cam.fov - yoffset/200);
+}
+
+/* Advance the world by one SIM_STEP and play the effects of what happened - no GL calls */
+void stepWorld ()
+{
+  int ticks = step(Sim, SIM_STEP);
+  for(size_t i=0; i<Sim.events.size(); i++){
+    const WorldEvent &e = Sim.events[i];
+    if(e.type == WORLD_IMPACT)spawnImpact(e);
+    else if(e.type == WORLD_FIRED)spawnMuzzle(e);
+    else if(e.type == WORLD_TARGET_HIT){
+      spawnParticles(PARTICLE_DEBRIS, e.x, e.y, 0, 0, 0.3, 2000, Sim.targetInner[3].color);
+      spawnParticles(PARTICLE_SMOKE, e.x, e.y, 0, 0, 0.05, 500, e.color);
+    }
+  }
+  Sim.events.clear();
+  for(int i=0; i<ticks; i++)updateParticles();
+}
+
+/* Describe the world to the snapshot being built - no GL calls */
+void emitWorld ()
+{
+  Scene.update();
+  emitLevel();
+
+  if(circleMode == CIRCLE_SDF)
+    emitTargetRings();
+  else{
+    //Tessellation follows the on-screen size; the rings share the target's mesh to keep their order
+    emitObject(Sim.targetA, LAYER_TARGET);
+    for(int i=0; i<4; i++)emitObject(Sim.targetInner[i], LAYER_TARGET, Sim.targetA.radius);
+  }
+  emitObject(Sim.cannon, LAYER_CIRCLES);
+  emitObject(Sim.cannonball, LAYER_CIRCLES);
+
+  for(int j=0; j<Sim.obstacleNumber; j++)emitObject(Sim.obstacle[j], LAYER_CIRCLES);
+
+  emitParticles();
+  emitPreview();
+}
+
+/* Take the latest aim and apply the input queued since the last step */
+void processInput ()
+{
+  AimPoint aim = Aim.load(std::memory_order_relaxed);
+  aimX = aim.x; aimY = aim.y;
+  InputEvent e;
+  while(popInput(e)){
+    if(e.type == INPUT_FIRE)fire(Sim, aimX, aimY);
+    else if(e.type == INPUT_CIRCLE_MODE)circleMode = (circleMode + 1) % 3;
+    else if(e.type == INPUT_VIEW)lodPixelsPerUnit = e.x;
+  }
+}
+
+/* Apply the queued input, run 'steps' SIM_STEPs and publish the snapshot they
+   lead to, shown in full from 'blendStart' + SIM_STEP on */
+void advanceSimulation (int steps, std::chrono::steady_clock::time_point blendStart)
+{
+    processInput();
+    for (int i = 0; i < steps; i++) {
+      stepWorld();
+      SimThread.steps++;
+    }
+    emitWorld();
+    Frame->level = Sim.level;
+    Frame->shots = Sim.shots;
+    Frame->particleCount = Particles.count;
+    Frame->blendStart = blendStart;
+    publishSnapshot();
+}
+
+/* Fixed timestep : real time is banked in an accumulator and spent in whole
+   SIM_STEPs, however late the thread wakes up, so the game runs at the same
+   speed whatever the display does. Each wake up publishes one snapshot. */
+void simulationLoop ()
+{
+    typedef std::chrono::steady_clock clock;
+    clock::duration tick = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(SIM_STEP));
+    clock::duration accumulator(0);
+    clock::time_point last = clock::now();
+    while (!SimThread.stop) {
+      clock::time_point now = clock::now();
+      accumulator += now - last;
+      last = now;
+      // Spiral of death: a stall longer than SIM_MAX_STEPS slows the game down instead
+      if (accumulator > SIM_MAX_STEPS*tick) {
+        SimThread.dropped += (accumulator - SIM_MAX_STEPS*tick)/tick;
+        accumulator = SIM_MAX_STEPS*tick;
+      }
+
+      if (accumulator >= tick) {
+        int steps = accumulator/tick;
+        accumulator -= steps*tick;
+        advanceSimulation(steps, now - accumulator);
+
+        std::lock_guard<std::mutex> lock(Pacing.simLock);
+        recordTime(Pacing.sim, std::chrono::duration<double, std::milli>(clock::now() - now).count());
+      }
+      std::this_thread::sleep_until(now + tick - accumulator);
+    }
+}
+
+/* The world must be set up (initWorld) before; from here on only the simulation thread touches it */
+void startSimulation ()
+{
+    initSnapshots();
+    SimThread.stop = 0;
+    SimThread.thread = std::thread(simulationLoop);
+}
+
+/* HUD : level, shots, frame rate and the profiler, as one text packet */
+std::chrono::steady_clock::time_point lastFrameTime;
+double frameMs = 0; // smoothed CPU time between frames
+
+void emitHUD (const Snapshot &frame)
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  double ms = std::chrono::duration<double, std::milli>(now - lastFrameTime).count();
+  lastFrameTime = now;
+  frameMs = frameMs ? 0.95*frameMs + 0.05*ms : ms;
+  if (!showHUD)
+    return;
+
+  static const float dark[4] = {0.1, 0.1, 0.15, 1};
+  static const double white[3] = {1, 1, 1};
+  char line[128];
+  float scale = 2, lineHeight = FONT_CELL_H*scale + 4, y = 8;
+
+  snprintf(line, sizeof(line), "LEVEL %d  SHOTS %d", frame.level, frame.shots);
+  addText(8, y, scale, line, dark); y += lineHeight;
+  if (hudTimings) {
+    snprintf(line, sizeof(line), "%.0f FPS  %.2f MS", frameMs > 0 ? 1000/frameMs : 0, frameMs);
+    addText(8, y, scale, line, dark); y += lineHeight;
+  }
+  if (hudTimings && Profiler.supported && Profiler.resolved) {
+    const double* gpu = Profiler.history[(Profiler.resolved - 1) % PROFILE_HISTORY];
+    snprintf(line, sizeof(line), "GPU CLEAR %.2f STATIC %.2f DYNAMIC %.2f HUD %.2f", gpu[GPU_CLEAR], gpu[GPU_STATIC], gpu[GPU_DYNAMIC], gpu[GPU_HUD]);
+    addText(8, y, scale, line, dark); y += lineHeight;
+  }
+  snprintf(line, sizeof(line), "DRAWS %d  OBJECTS %d/%d  CELLS %d/%d  PARTICLES %d", Queue.draws,
+           Culling.visibleObjects, Culling.visibleObjects + Culling.culledObjects,
+           Culling.visibleCells, Culling.visibleCells + Culling.culledCells, frame.particleCount);
+  addText(8, y, scale, line, dark);
+
+  Queue.packets.push_back(makePacket(LAYER_HUD, PROGRAM_TEXT, MESH_TEXT, GL_FILL, 0, makeInstance(0, 0, 1, 1, white)));
 }
 
 /* Render the scene with openGL */
@@ -600,73 +3217,35 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 
 void draw ()
 {
+  resetGLStateCounters();
+
   // clear the color and depth in the frame buffer
+  gpuScope(GPU_CLEAR);
   glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  glClearColor(0.9f, 0.9f, 0.98f, 0.0f);
+  cachedClearColor(0.9f, 0.9f, 0.98f, 0.0f);
   // use the loaded shader program
   // Don't change unless you know what you are doing
-  glUseProgram (programID);
-
-  // Eye - Location of camera. Don't change unless you are sure!!
-  glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-  // Target - Where is the camera looking at.  Don't change unless you are sure!!
-  glm::vec3 target (0, 0, 0);
-  // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-  glm::vec3 up (0, 1, 0);
-
-  // Compute Camera matrix (view)
-  // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-
-  //  Don't change unless you are sure!!
-  if(panState==1)panX+=xposNew/100, panY+=yposNew/100;
-  Matrices.view = glm::lookAt(glm::vec3(panX,panY,3), glm::vec3(panX,panY,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-  int fbwidth=1280, fbheight=720;
-  Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
-  // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-  //  Don't change unless you are sure!!
-  VP = Matrices.projection * Matrices.view;
-
-  Matrices.model = glm::mat4(1.0f);
-
-  // Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
-  // glPopMatrix ();
-
-  World.update();
-
-  //draw walls
-  for(int i=0; i<4; i++){wall[i].update(); checkCollision(wall[i], cannonball);}
-  for(int i=0; i<4; i++){wall[i].update(); checkCollision(wall[i], targetA);}
-  for(int i=0; i<platformNumber; i++){platform[i].update(); checkCollision(platform[i], targetA);}
-  for(int i=0; i<4; i++)for(int j=0; j<obstacleNumber; j++)checkCollision(wall[i], obstacle[j]);
-  for(int i=0 ; i<platformNumber; i++)for(int j=0; j<obstacleNumber; j++)checkCollision(platform[i], obstacle[j]);
-  for(int j=0; j<obstacleNumber; j++)if(checkCollisionCircle(cannonball, obstacle[j]));
-  for(int i=0; i<platformNumber; i++){platform[i].update(); checkCollision(platform[i], cannonball);}
-  for(int i=0; i<obstacleNumber; i++)for(int j=0; j<i; j++)checkCollisionCircle(obstacle[i], obstacle[j]);
-
-  //for(int i=0; i<obstacleNumber; i++)for(int j=0; j<obstacleNumber; j++)checkCollisionCircle(obstacle[i], obstacle[j]);
-  targetA.update();
-  for(int i=0; i<4; i++)targetInner[i].update();
-
-  //Draw cannon
-  cannon.update();
-  //Draw cannonball
-  cannonball.update();
-
-  for(int j=0; j<obstacleNumber; j++)
-  obstacle[j].update();
-
-  if(checkCollisionCircle(cannonball, targetA)){
-    cannonball.isPhysics = 0; cannonball.reset(canX , canY);
-    level++; if(level > NUMBER_OF_LEVELS)level = 1;
-    levelGen();
-
-    if (targetA.xVel>1) {
-      targetA.xVel = 1;
-    }
-    if (targetA.yVel>1) {
-      targetA.yVel = 1  ;
-    }
+  cachedUseProgram (programID);
+
+  // Right drag pans towards the cursor, faster the further it is from the center
+  if(panState==1)panCamera((xposNew-Cam.panX)/100, (yposNew-Cam.panY)/100);
+
+  // The simulation thread's latest snapshot; its draws are submitted once all transforms are uploaded
+  const Snapshot &frame = acquireSnapshot();
+  beginTransforms();
+  loadSnapshot(frame, snapshotBlend(frame, std::chrono::steady_clock::now()));
+  emitHUD(frame);
+
+  //Camera only when it moved, per-draw transforms once for the whole frame
+  if(updateCamera()){
+    uploadCamera(Cam.VP);
+    pushInput(INPUT_VIEW, Cam.height/(2*cameraHalfHeight()));
   }
+  uploadTransforms();
+  submitRenderQueue();
+  endStreamFrame();
+  endGPUFrame();
+
   glFlush();
 }
 
@@ -696,7 +3275,7 @@ GLFWwindow* initGLFW (int width, int height)
 
     glfwMakeContextCurrent(window);
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
+    setSwapInterval(Scheduler.swapInterval);
 
     /* --- register callbacks with GLFW --- */
 
@@ -720,30 +3299,167 @@ GLFWwindow* initGLFW (int width, int height)
     return window;
 }
 
+/* Headless mode : a GL 3.3 core context from EGL on a surfaceless display, no
+   window system needed (Mesa's llvmpipe works). Frames go to an offscreen
+   framebuffer of the requested size. There is no simulation thread: game time
+   is virtual, frameSteps SIM_STEPs before each frame, so frame N comes out the
+   same on every run and machine. */
+#define HEADLESS_FRAME_STEPS 2 // 50 fps of game time
+
+struct HeadlessContext {
+    int enabled;
+    long maxFrames; // frames to render before exiting, 0 to run until killed
+    int frameSteps; // SIM_STEPs per frame
+#ifdef __linux__
+    EGLDisplay display;
+    EGLContext context;
+#endif
+    GLuint Framebuffer, ColorBuffer, DepthBuffer;
+} Headless;
+
+void initHeadless (int width, int height)
+{
+#ifdef __linux__
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    Headless.display = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL)
+                                          : EGL_NO_DISPLAY;
+    EGLint major, minor;
+    if (Headless.display == EGL_NO_DISPLAY || !eglInitialize(Headless.display, &major, &minor)) {
+        // No surfaceless platform, try the default display
+        Headless.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (Headless.display == EGL_NO_DISPLAY || !eglInitialize(Headless.display, &major, &minor)) {
+            cerr << "headless: no EGL display" << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    eglBindAPI(EGL_OPENGL_API);
+    eglChooseConfig(Headless.display, configAttribs, &config, 1, &numConfigs);
+    Headless.context = numConfigs ? eglCreateContext(Headless.display, config, EGL_NO_CONTEXT, contextAttribs) : EGL_NO_CONTEXT;
+    if (Headless.context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(Headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, Headless.context)) {
+        cerr << "headless: can't create a surfaceless GL 3.3 core context" << endl;
+        exit(EXIT_FAILURE);
+    }
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+    // Offscreen target, left bound for the whole run
+    glGenRenderbuffers(1, &Headless.ColorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, Headless.ColorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &Headless.DepthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, Headless.DepthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glGenFramebuffers(1, &Headless.Framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, Headless.Framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, Headless.ColorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, Headless.DepthBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        cerr << "headless: incomplete framebuffer" << endl;
+        exit(EXIT_FAILURE);
+    }
+#else
+    cerr << "headless mode needs EGL, only available on Linux" << endl;
+    exit(EXIT_FAILURE);
+#endif
+}
+
+void destroyHeadless ()
+{
+#ifdef __linux__
+    eglMakeCurrent(Headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(Headless.display, Headless.context);
+    eglTerminate(Headless.display);
+#endif
+}
+
 /* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
+/* Build a program and swap it in place of 'program' only if it links,
+   the old one stays in use otherwise */
+bool swapProgram (GLuint &program, const char* vertex_file_path, const char* fragment_file_path)
+{
+	ShaderReport report;
+	GLuint fresh = LoadShaders(vertex_file_path, fragment_file_path, &report);
+	if (!fresh) {
+		printShaderReport(report);
+		return false;
+	}
+	if (program)
+		glDeleteProgram(program);
+	program = fresh;
+	GLState.program = 0; // the deleted name may come back from glCreateProgram
+	bindUniformBlocks(program);
+	return true;
+}
+
+/* (Re)build every program and resolve its uniforms, at startup and on shader edits */
+void loadPrograms ()
+{
+	swapProgram(programID, "Sample_GL.vert", "Sample_GL.frag");
+
+	if (swapProgram(TextShader.ID, "Sample_GL_text.vert", "Sample_GL_text.frag"))
+		TextShader.ScreenSizeID = glGetUniformLocation(TextShader.ID, "screenSize");
+
+	if (swapProgram(ParticleShader.ID, "Sample_GL_particle.vert", "Sample_GL_particle.frag"))
+		ParticleShader.PointScaleID = glGetUniformLocation(ParticleShader.ID, "pointScale");
+
+	if (swapProgram(CircleShader.ID, "Sample_GL_circle.vert", "Sample_GL_circle.frag")) {
+		CircleShader.RingCountID = glGetUniformLocation(CircleShader.ID, "ringCount");
+		CircleShader.RingRadiusID = glGetUniformLocation(CircleShader.ID, "ringRadius");
+		CircleShader.RingColorID = glGetUniformLocation(CircleShader.ID, "ringColor");
+	}
+}
+
+const char* gpuCSVPath = NULL;
+
 void initGL (GLFWwindow* window, int width, int height)
 {
     /* Objects should be created before any other gl function and shaders */
-  World.mapInit();
-  makewalls();
-  cannonball.objInit(77, 77, canR); cannonball.setColor(1, 0.7, 0) ;cannonball.isPhysics = 1;
-  for(int j=0; j<obstacleNumber; j++)obstacle[j].objInit(random(-6, 6), random(-6, 6), canR); //obstacle.isPhysics = 1;
-  cannon.objInit(canX, canY, 1.4);
+  invalidateGLState();
+  Scene.mapInit();
+  initStreamBuffer();
+  initParticles();
+  initFontAtlas();
+  initGPUProfiler(gpuCSVPath);
+  resetInstanceAttributes();
 
 
 	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	// Both programs read VP and the model matrix from the shared uniform blocks
+	initUniformBlocks();
+	loadPrograms();
+	startShaderWatcher(".");
 	reshapeWindow (window, width, height);
   // Background color of the scene
-	glClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
+	cachedClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
 	glClearDepth (1.0f);
 
 	glEnable (GL_DEPTH_TEST);
 	glDepthFunc (GL_LEQUAL);
 
+	// Anti-aliased circle edges are blended over the background
+	glEnable (GL_BLEND);
+	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	// Particles size their point sprites in the vertex shader
+	glEnable (GL_PROGRAM_POINT_SIZE);
+
     cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
     cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
     cout << "VERSION: " << glGetString(GL_VERSION) << endl;
@@ -754,37 +3470,134 @@ int main (int argc, char** argv)
 {
 	int width = 1280;
 	int height = 720;
+	const char* captureTarget = NULL;
+	int obstacles = 0;
+    Headless.frameSteps = HEADLESS_FRAME_STEPS;
+
+    for (int i = 1; i < argc; i++) {
+        // --obstacles N : number of random obstacles to spawn
+        if (string(argv[i]) == "--obstacles" && i+1 < argc)
+            obstacles = atoi(argv[++i]);
+        // --gpu-csv FILE : write the GPU time of every frame's scopes to FILE
+        else if (string(argv[i]) == "--gpu-csv" && i+1 < argc)
+            gpuCSVPath = argv[++i];
+        // --headless : render offscreen through EGL, as fast as possible, on virtual game time
+        else if (string(argv[i]) == "--headless")
+            Headless.enabled = 1;
+        // --size WxH : window or offscreen framebuffer size
+        else if (string(argv[i]) == "--size" && i+1 < argc)
+            sscanf(argv[++i], "%dx%d", &width, &height);
+        // --capture TARGET : record every frame, to TARGET if it is a PNG file
+        // pattern (frames/%05ld.png), as raw RGB24 to the file or pipe TARGET otherwise ("-" for stdout,
+        // which then carries only frames: text goes to stderr)
+        else if (string(argv[i]) == "--capture" && i+1 < argc)
+            captureTarget = argv[++i];
+        // --frames N : stop after N headless frames
+        else if (string(argv[i]) == "--frames" && i+1 < argc)
+            Headless.maxFrames = atol(argv[++i]);
+        // --frame-steps N : headless game time per frame, in SIM_STEPs of 10 ms
+        else if (string(argv[i]) == "--frame-steps" && i+1 < argc)
+            Headless.frameSteps = max(atoi(argv[++i]), 0);
+        // --fps N : cap the window's frame rate, 0 for none (keys: f cycles caps); with
+        // vsync on the swap paces frames too, and late frames are only counted with it off
+        else if (string(argv[i]) == "--fps" && i+1 < argc)
+            Scheduler.cap = atof(argv[++i]);
+        // --vsync MODE : 1 on, 0 off, -1 adaptive (keys: y cycles modes)
+        else if (string(argv[i]) == "--vsync" && i+1 < argc) {
+            Scheduler.swapInterval = atoi(argv[++i]);
+            if (Scheduler.swapInterval < -1 || Scheduler.swapInterval > 1) {
+                cerr << "--vsync: expected 1, 0 or -1, got " << argv[i] << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (captureTarget && string(captureTarget) == "-")
+        claimStdoutForCapture();
+
+    if (Headless.enabled) {
+        initHeadless(width, height);
+        if (!initWorld(Sim, obstacles))
+            cerr << "Missing level file 1.txt" << endl;
+        initGL (NULL, width, height);
+        initSnapshots();
+        hudTimings = 0;
+        if (captureTarget)
+            initCapture(captureTarget, width, height);
+
+        // No vsync and no frame gate: step virtual time, then draw() its snapshot in full
+        long frames = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (!Headless.maxFrames || frames < Headless.maxFrames) {
+            std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+            if (shadersChanged())
+                loadPrograms();
+            advanceSimulation(Headless.frameSteps, std::chrono::steady_clock::time_point());
+            recordTime(Pacing.sim, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+            draw();
+            captureFrame();
+            recordTime(Pacing.cpu, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+            recordSwap(); // no swap, the time between frames
+            frames++;
+        }
+        glFinish();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cout << frames << " frames in " << seconds << " s (" << frames/seconds << " fps)" << endl;
+
+        printFramePacing();
+        stopShaderWatcher();
+        stopCapture();
+        Meshes.contextLost = 1;
+        destroyHeadless();
+        exit(EXIT_SUCCESS);
+    }
 
     GLFWwindow* window = initGLFW(width, height);
-    levelGen();
+    if (!initWorld(Sim, obstacles))
+        cerr << "Missing level file 1.txt" << endl;
 	   initGL (window, width, height);
+    startSimulation();
+    if (captureTarget)
+        initCapture(captureTarget, Cam.width, Cam.height);
 
-    double last_update_time = glfwGetTime(), current_time;
+    setFrameCap(Scheduler.cap);
 
-    /* Draw in loop */
+    /* Draw in loop, paced by the frame scheduler */
     while (!glfwWindowShouldClose(window)) {
-
-        // OpenGL Draw commands
-
-
-        // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-        current_time = glfwGetTime(); // Time in seconds
-        if ((current_time - last_update_time) >= 0.01) { // atleast 0.5s elapsed since last frame
-            // do something every 0.5 seconds ..
-            draw();
-
-            // Swap Frame Buffer in double buffering
-            glfwSwapBuffers(window);
-
-            glfwGetCursorPos(window, &xpos, &ypos);
-            xposNew = (xpos-(1280/2))*32*fov/(2.498*1280); yposNew = (-ypos+(720/2))*fov*18/(2.498*720);
-            //cout<<ypos<<" "<<xposNew<<" "<<yposNew<<" "<<(yposNew+7)/(xposNew+14)<<endl;
-            // Poll for Keyboard and mouse events
-            glfwPollEvents();
-            last_update_time = current_time;
+        // Nothing to show while minimized; the simulation keeps running
+        if (glfwGetWindowAttrib(window, GLFW_ICONIFIED)) {
+            glfwWaitEventsTimeout(SCHEDULER_IDLE);
+            setFrameCap(Scheduler.cap);
+            Pacing.lastSwap = std::chrono::steady_clock::time_point(); // not a stutter
+            continue;
         }
+
+        std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+        if (shadersChanged())
+            loadPrograms(); // between frames, on this thread
+        draw();
+        captureFrame(); // reads the back buffer
+        recordTime(Pacing.cpu, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+
+        // Swap Frame Buffer in double buffering
+        glfwSwapBuffers(window);
+        recordSwap();
+
+        glfwGetCursorPos(window, &xpos, &ypos);
+        int windowWidth, windowHeight;
+        glfwGetWindowSize(window, &windowWidth, &windowHeight);
+        screenToWorld(xpos, ypos, windowWidth, windowHeight, xposNew, yposNew);
+        publishAim(xposNew, yposNew);
+        //cout<<ypos<<" "<<xposNew<<" "<<yposNew<<" "<<(yposNew+7)/(xposNew+14)<<endl;
+        // Poll for Keyboard and mouse events
+        glfwPollEvents();
+        waitForFrame();
     }
 
+    stopSimulation();
+    printFramePacing();
+    stopShaderWatcher();
+    stopCapture();
+    Meshes.contextLost = 1;
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,39 @@
+#version 330 core
+
+#define MAX_RINGS 8
+
+// Interpolated values from the vertex shaders
+in vec2 localPosition;
+in vec3 fragColor;
+
+// Concentric rings, outermost first, radii as a fraction of the circle radius.
+// With ringCount == 0 the circle is filled with the instance color.
+uniform int ringCount;
+uniform float ringRadius[MAX_RINGS];
+uniform vec3 ringColor[MAX_RINGS];
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Distance from the center, and how much of it one pixel covers,
+    // so edges stay one pixel wide at every zoom level
+    float dist = length(localPosition);
+    float aa = fwidth(dist);
+
+    // Coverage of the outer edge
+    float alpha = 1.0 - smoothstep(1.0 - aa, 1.0 + aa, dist);
+    if (alpha <= 0.0)
+        discard;
+
+    vec3 rgb = fragColor;
+    if (ringCount > 0)
+        rgb = ringColor[0];
+    for (int i = 1; i < ringCount; i++) {
+        float inside = 1.0 - smoothstep(ringRadius[i] - aa, ringRadius[i] + aa, dist);
+        rgb = mix(rgb, ringColor[i], inside);
+    }
+
+    color = vec4(rgb, alpha);
+}
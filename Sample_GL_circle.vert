@@ -0,0 +1,30 @@
+#version 330 core
+
+// input data : corners of the [-1, 1] quad around each circle
+layout (location = 0) in vec2 vertexPosition;
+
+// per-instance data : center (xy) and radius (zw), and the fill color
+layout (location = 2) in vec4 instanceTransform;
+layout (location = 3) in vec3 instanceColor;
+
+// shared by all programs : view-projection once per frame,
+// and the model matrix of the current draw (identity when instanced)
+layout (std140) uniform Camera {
+    mat4 VP;
+};
+layout (std140) uniform Object {
+    mat4 model;
+};
+
+// output data : used by fragment shader
+out vec2 localPosition; // position relative to the center, in radii
+out vec3 fragColor;
+
+void main ()
+{
+    localPosition = vertexPosition;
+    fragColor = instanceColor;
+
+    vec2 position = vertexPosition * instanceTransform.zw + instanceTransform.xy;
+    gl_Position = VP * model * vec4(position, 0, 1);
+}
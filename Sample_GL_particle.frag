@@ -0,0 +1,17 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec4 fragColor;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Round sprite, soft towards its edge
+    float dist = length(gl_PointCoord * 2.0 - 1.0);
+    if (dist > 1.0)
+        discard;
+
+    color = vec4(fragColor.rgb, fragColor.a * (1.0 - dist * dist));
+}
@@ -0,0 +1,24 @@
+#version 330 core
+
+// input data : one point sprite per particle
+layout (location = 0) in vec2 vertexPosition;
+layout (location = 1) in vec4 vertexColor; // alpha fades with the particle's life
+layout (location = 2) in float vertexSize; // diameter in world units
+
+// shared by all programs : view-projection once per frame
+layout (std140) uniform Camera {
+    mat4 VP;
+};
+
+// pixels per world unit at the z = 0 plane
+uniform float pointScale;
+
+// output data : used by fragment shader
+out vec4 fragColor;
+
+void main ()
+{
+    fragColor = vertexColor;
+    gl_PointSize = max(vertexSize * pointScale, 1.0);
+    gl_Position = VP * vec4(vertexPosition, 0, 1);
+}
@@ -0,0 +1,20 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 uv;
+in vec4 fragColor;
+
+// one channel glyph atlas, 1 inside a glyph
+uniform sampler2D atlas;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    float coverage = texture(atlas, uv).r;
+    if (coverage <= 0.0)
+        discard;
+
+    color = vec4(fragColor.rgb, fragColor.a * coverage);
+}
@@ -0,0 +1,23 @@
+#version 330 core
+
+// input data : glyph quad corners in framebuffer pixels, top left origin
+layout (location = 0) in vec2 vertexPosition;
+layout (location = 1) in vec2 vertexUV;    // into the glyph atlas
+layout (location = 2) in vec4 vertexColor;
+
+// framebuffer size in pixels
+uniform vec2 screenSize;
+
+// output data : used by fragment shader
+out vec2 uv;
+out vec4 fragColor;
+
+void main ()
+{
+    uv = vertexUV;
+    fragColor = vertexColor;
+
+    // In front of everything: the HUD is not part of the scene
+    vec2 ndc = vertexPosition / screenSize * 2.0 - 1.0;
+    gl_Position = vec4(ndc.x, -ndc.y, -1, 1);
+}
@@ -0,0 +1,259 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <algorithm>
+#include "simulation.h"
+
+using namespace std;
+
+static int random(int min, int max) //range : [min, max)
+{
+   static bool first = true;
+   if ( first )
+   {
+      srand(time(NULL)); //seeding for the first time only!
+      first = false;
+   }
+   return min + rand() % (max - min);
+}
+
+int checkCollision(obj &A, obj &B){ //B is a circle, A is a rectangle, 1 if B bounced
+  double xRect = A.xPos; double yRect = A.yPos; double width = A.width; double height = A.height;
+  double x = B.xPos; double y = B.yPos; double yVel = B.yVel; double xVel = B.xVel;
+  //cout<<x<<" "<<y<<" "<<yVel<<" "<<xVel<<endl;
+  if(x > xRect && x < xRect+width && y > yRect+height && y+yVel-B.radius<yRect+height){
+    B.yPos=yRect+height+B.radius;
+    //cout<<B.yPos<<" "<<cannonball.yPos<<endl;
+    B.yVel*=-0.9;
+    B.xVel*=0.98;
+  }
+  else if(x > xRect && x < xRect+width && y < yRect&& y+yVel+B.radius>yRect){
+    B.yPos=yRect-B.radius;
+    B.yVel*=-0.9;
+  }
+  else if(y > yRect && y < yRect+height && x > xRect+width && x+xVel-B.radius<xRect+width){
+    B.xPos = xRect+width+B.radius;
+    B.xVel*=-1;
+  }
+  else if(y > yRect && y < yRect+height && x < xRect && x+xVel+B.radius>xRect){
+    B.xPos = xRect-B.radius;
+    B.xVel*=-1;
+  }
+  else return 0;
+  return 1;
+}
+
+int checkCollisionCircle(obj &firstBall, obj &secondBall){ //Circle //For now, B is target
+  if (firstBall.xPos + firstBall.radius + secondBall.radius > secondBall.xPos
+    && firstBall.xPos < secondBall.xPos + firstBall.radius + secondBall.radius
+    && firstBall.yPos + firstBall.radius + secondBall.radius > secondBall.yPos
+    && firstBall.yPos < secondBall.yPos + firstBall.radius + secondBall.radius)
+  {
+    //AABBs are overlapping
+    if(secondBall.xVel < firstBall.xVel)
+    secondBall.xVel += firstBall.xVel*0.5, firstBall.xVel /= 2;
+    else
+    firstBall.xVel += secondBall.xVel*0.5, secondBall.xVel /= 2;
+
+    if(secondBall.yVel < firstBall.yVel)
+    secondBall.yVel += firstBall.yVel*0.5, firstBall.yVel /= 2;
+    else
+    firstBall.yVel += secondBall.yVel*0.5, secondBall.yVel/=2;
+    return 1;
+  }
+  return 0;
+}
+
+/* Rebuild the collision lists of grid.rects */
+void bakeLevelGrid (LevelGrid &grid)
+{
+    grid.generation++;
+    grid.gridX = grid.gridY = 0;
+    grid.columns = grid.rows = 1;
+    grid.cellStart.assign(2, 0);
+    grid.cellRects.clear();
+    int n = grid.rects.size();
+    grid.stamp.assign(n, 0);
+    grid.query = 0;
+    if (n == 0)
+      return;
+
+    float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+    for (int i = 0; i < n; i++) {
+      const LevelRect &r = grid.rects[i];
+      minX = min(minX, (float) r.x); minY = min(minY, (float) r.y);
+      maxX = max(maxX, (float) (r.x + r.width)); maxY = max(maxY, (float) (r.y + r.height));
+    }
+    int columns = (int) ((maxX - minX)/LEVEL_CELL) + 1, rows = (int) ((maxY - minY)/LEVEL_CELL) + 1;
+    grid.gridX = minX; grid.gridY = minY;
+    grid.columns = columns; grid.rows = rows;
+
+    // Count the cells' rectangles, then fill them in
+    grid.cellStart.assign(columns*rows + 1, 0);
+    vector<int> fill;
+    for (int pass = 0; pass < 2; pass++) {
+      for (int i = 0; i < n; i++) {
+        const LevelRect &r = grid.rects[i];
+        int x0 = (int) ((r.x - minX)/LEVEL_CELL), x1 = min((int) ((r.x + r.width - minX)/LEVEL_CELL), columns-1);
+        int y0 = (int) ((r.y - minY)/LEVEL_CELL), y1 = min((int) ((r.y + r.height - minY)/LEVEL_CELL), rows-1);
+        for (int cy = y0; cy <= y1; cy++)
+          for (int cx = x0; cx <= x1; cx++) {
+            int c = cy*columns + cx;
+            if (pass == 0)
+              grid.cellStart[c + 1]++;
+            else
+              grid.cellRects[fill[c]++] = i;
+          }
+      }
+      if (pass == 0) {
+        for (int c = 0; c < columns*rows; c++)
+          grid.cellStart[c+1] += grid.cellStart[c];
+        grid.cellRects.resize(grid.cellStart.back());
+        fill.assign(grid.cellStart.begin(), grid.cellStart.end() - 1);
+      }
+    }
+}
+
+/* Indices of the level rectangles whose cells overlap 'box' (minX, minY, maxX, maxY),
+   each once, into 'out' */
+void levelRectsNear (LevelGrid &grid, const float box[4], vector<int> &out)
+{
+    out.clear();
+    if (grid.rects.empty())
+      return;
+    grid.query++;
+    int x0 = max((int) floor((box[0] - grid.gridX)/LEVEL_CELL), 0), x1 = min((int) floor((box[2] - grid.gridX)/LEVEL_CELL), grid.columns-1);
+    int y0 = max((int) floor((box[1] - grid.gridY)/LEVEL_CELL), 0), y1 = min((int) floor((box[3] - grid.gridY)/LEVEL_CELL), grid.rows-1);
+    for (int cy = y0; cy <= y1; cy++)
+      for (int cx = x0; cx <= x1; cx++) {
+        int c = cy*grid.columns + cx;
+        for (int k = grid.cellStart[c]; k < grid.cellStart[c+1]; k++) {
+          int i = grid.cellRects[k];
+          if (grid.stamp[i] != grid.query) {
+            grid.stamp[i] = grid.query;
+            out.push_back(i);
+          }
+        }
+      }
+}
+
+static void addLevelRect(World &w, obj &o){
+  LevelRect r = { o.xPos, o.yPos, o.width, o.height, { o.color[0], o.color[1], o.color[2] } };
+  w.grid.rects.push_back(r);
+}
+
+obj &levelObj(World &w, int i){
+  return i < 4 ? w.wall[i] : w.platform[i-4];
+}
+
+bool loadLevel(World &w, int level){
+  char levelString[16];
+  snprintf(levelString, sizeof(levelString), "%d.txt", level);
+  ifstream fin(levelString);
+  if(!fin)return false;
+  w.level = level;
+  fin>>w.platformNumber;
+  vector<double> platformData(4*w.platformNumber);
+  for(int i=0; i<4*w.platformNumber; i++)fin>>platformData[i];
+  double targetX = 1, targetY = 1;
+  fin>>targetX;
+  fin>>targetY;
+
+  w.wall[0].objInit(-16, -9, 32, 0.2);
+  w.wall[1].objInit(-16, -9, 0.2, 18);
+  w.wall[2].objInit(-16, 8.8, 32, 0.2);
+  w.wall[3].objInit(15.8, -9, 0.2, 18);
+  w.platform.resize(w.platformNumber);
+  for(int i=0; i<w.platformNumber; i++)
+    w.platform[i].objInit(platformData[4*i], platformData[4*i+1], platformData[4*i+2], platformData[4*i+3]);
+
+  w.grid.rects.clear();
+  for(int i=0; i<4; i++)addLevelRect(w, w.wall[i]);
+  for(int i=0; i<w.platformNumber; i++)addLevelRect(w, w.platform[i]);
+  bakeLevelGrid(w.grid);
+
+  w.targetA.objInit(targetX, targetY, 0.8); w.targetA.reset(targetX, targetY);
+  w.targetInner[0].objInit(targetX, targetY, 0.6); w.targetInner[0].setColor(1, 1, 0.878);
+  w.targetInner[1].objInit(targetX, targetY, 0.5); w.targetInner[1].setColor(0.275, 0.510, 0.706);
+  w.targetInner[2].objInit(targetX, targetY, 0.4); w.targetInner[2].setColor(0.902, 0.902, 0.980);
+  w.targetInner[3].objInit(targetX, targetY, 0.3); w.targetInner[3].setColor(0.863, 0.078, 0.235);
+  return true;
+}
+
+bool initWorld(World &w, int obstacles){
+  w = World();
+  w.canX = -14; w.canY = -7; w.canR = 0.4;
+  bool loaded = loadLevel(w, 1);
+  w.cannonball.objInit(77, 77, w.canR); w.cannonball.setColor(1, 0.7, 0); w.cannonball.isPhysics = 1;
+  w.obstacleNumber = obstacles;
+  w.obstacle.resize(obstacles);
+  for(int j=0; j<obstacles; j++)w.obstacle[j].objInit(random(-6, 6), random(-6, 6), w.canR);
+  w.cannon.objInit(w.canX, w.canY, 1.4);
+  return loaded;
+}
+
+static void addEvent(World &w, int type, const obj &o, const double color[3]){
+  WorldEvent e = { type, o.xPos, o.yPos, o.xVel, o.yVel, { color[0], color[1], color[2] } };
+  w.events.push_back(e);
+}
+
+void fire(World &w, double aimX, double aimY){
+  w.shots++;
+  obj &cannonball = w.cannonball;
+  double canX = w.canX, canY = w.canY;
+  cannonball.isPhysics = 1;
+  double a = sqrt((aimX-canX)*(aimX-canX) + (aimY-canY)*(aimY-canY));
+  cannonball.reset(canX + (aimX-canX)*0/a , canY + (aimY-canY)*0/a);
+  cannonball.xVel = (aimX-canX)*1/20 ; cannonball.yVel = (aimY-canY)*1/20;
+  addEvent(w, WORLD_FIRED, cannonball, cannonball.color);
+}
+
+/* One WORLD_TICK: collide, then move */
+static void tick(World &w){
+  obj &cannonball = w.cannonball, &targetA = w.targetA;
+  //walls and platforms are baked, only collide with them
+  for(int i=0; i<4; i++)if(checkCollision(w.wall[i], cannonball))addEvent(w, WORLD_IMPACT, cannonball, w.wall[i].color);
+  for(int i=0; i<4; i++)checkCollision(w.wall[i], targetA);
+  for(int i=0; i<w.platformNumber; i++)checkCollision(w.platform[i], targetA);
+  for(int i=0; i<4; i++)for(int j=0; j<w.obstacleNumber; j++)checkCollision(w.wall[i], w.obstacle[j]);
+  for(int i=0 ; i<w.platformNumber; i++)for(int j=0; j<w.obstacleNumber; j++)checkCollision(w.platform[i], w.obstacle[j]);
+  for(int j=0; j<w.obstacleNumber; j++)checkCollisionCircle(cannonball, w.obstacle[j]);
+  for(int i=0; i<w.platformNumber; i++)if(checkCollision(w.platform[i], cannonball))addEvent(w, WORLD_IMPACT, cannonball, w.platform[i].color);
+  for(int i=0; i<w.obstacleNumber; i++)for(int j=0; j<i; j++)checkCollisionCircle(w.obstacle[i], w.obstacle[j]);
+
+  targetA.update();
+  for(int i=0; i<4; i++)w.targetInner[i].update();
+  w.cannon.update();
+  cannonball.update();
+  for(int j=0; j<w.obstacleNumber; j++)w.obstacle[j].update();
+
+  if(checkCollisionCircle(cannonball, targetA)){
+    addEvent(w, WORLD_TARGET_HIT, targetA, targetA.color);
+    cannonball.isPhysics = 0; cannonball.reset(w.canX , w.canY);
+    int next = w.level + 1; if(next > NUMBER_OF_LEVELS)next = 1;
+    w.shots = 0;
+    loadLevel(w, next);
+
+    if (targetA.xVel>1) {
+      targetA.xVel = 1;
+    }
+    if (targetA.yVel>1) {
+      targetA.yVel = 1  ;
+    }
+  }
+}
+
+int step(World &w, double dt){
+  int ticks = 0;
+  w.pending += dt;
+  // Tolerate rounding, so that step(w, WORLD_TICK) always runs exactly one tick
+  while(w.pending >= WORLD_TICK*(1 - 1e-6)){
+    tick(w);
+    w.pending -= WORLD_TICK;
+    w.ticks++;
+    ticks++;
+  }
+  return ticks;
+}
@@ -0,0 +1,114 @@
+/* Simulation core : the cannon game's objects, collisions and level state,
+   with no GL or window dependency, so that the game, headless tools and
+   benchmarks can all run the same physics. The game steps it on its
+   simulation thread and only reads it to describe the frame. */
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <vector>
+
+static const double airResistance = 0.985;
+static const double gravity = 0.01;
+static const int NUMBER_OF_LEVELS = 4;
+#define WORLD_TICK 0.01 // seconds of game time per integration step, the rate the constants above were tuned at
+#define LEVEL_CELL 4.0f // world units per side of a level grid cell
+
+class obj{
+public:
+  int is_circle, isPhysics;
+  double xPos, yPos, width, height, radius;
+  double xVel, yVel, xAcc, yAcc;
+  double xPrev, yPrev; //position before the last update
+  double color[3];
+
+  void objInit(double xPosNew,double yPosNew, double widthNew, double heightNew){
+    xPos = xPosNew; yPos = yPosNew;
+    width = widthNew; height = heightNew;
+    is_circle = 0; color[0] = 1; color[1] = 0; color[2] = 0;
+  }
+  void objInit(double xPosNew,double yPosNew,double radiusNew){
+    xPos = xPosNew; yPos = yPosNew; radius = radiusNew;
+    is_circle = 1; color[0] = 1; color[1] = 0.843; color[2] = 0;
+    isPhysics = 0;
+    update();
+  }
+  void setColor(double col1, double col2, double col3){
+    color[0] = col1; color[1] = col2; color[2] = col3;
+    update();
+  }
+  void reset(double xPosNew, double yPosNew){
+    xPos = xPosNew; yPos = yPosNew;
+    xVel = yVel = xAcc = yAcc = 0;
+    update();
+  }
+  void update(){
+    //if(radius!=0.1)checkCollision(xPos, yPos, width, height);
+    xPrev = xPos; yPrev = yPos;
+    xVel += xAcc; yVel += yAcc;
+    xPos += xVel; yPos += yVel;
+    //if(xVel > 0.4)xVel=0.4; if(yVel>0.4)yVel=0.4;
+    if(isPhysics==1) updatePhysics();
+  }
+  void updatePhysics(){
+    xVel *= airResistance; yVel *= airResistance;
+    yAcc = -gravity;
+  }
+};
+
+int checkCollision(obj &A, obj &B); //B is a circle, A is a rectangle, 1 if B bounced
+int checkCollisionCircle(obj &firstBall, obj &secondBall);
+
+struct LevelRect {
+    double x, y, width, height, color[3];
+};
+
+/* Walls and platforms never move. Every rectangle is listed in each grid cell
+   it overlaps, so a moving circle is only tested against its neighbours. */
+struct LevelGrid {
+    std::vector<LevelRect> rects; // walls, then platforms
+    int generation;               // bumped by every bake, the first one makes it 1
+    float gridX, gridY;           // world position of the grid's corner
+    int columns, rows;
+    std::vector<int> cellStart, cellRects; // rectangles of cell c: cellRects[cellStart[c] .. cellStart[c+1])
+    std::vector<int> stamp;       // last query that returned each rectangle
+    int query;
+};
+
+void bakeLevelGrid(LevelGrid &grid);
+void levelRectsNear(LevelGrid &grid, const float box[4], std::vector<int> &out);
+
+/* What happened during step() or fire(), for the caller's effects */
+#define WORLD_IMPACT 0     // the ball bounced off a wall or platform: its position, velocity, the rectangle's color
+#define WORLD_FIRED 1      // the cannon's position, the ball's velocity
+#define WORLD_TARGET_HIT 2 // where the target was; the next level is already loaded
+
+struct WorldEvent {
+    int type;
+    double x, y, xVel, yVel;
+    double color[3];
+};
+
+struct World {
+    obj cannonball, cannon, targetA, targetInner[4], wall[4];
+    std::vector<obj> obstacle, platform;
+    int platformNumber, obstacleNumber;
+    double canX, canY, canR;
+    int level, shots;                // shots fired on this level
+    LevelGrid grid;
+    std::vector<WorldEvent> events;  // since the caller last cleared them
+    double pending;                  // seconds handed to step() but not simulated yet
+    long ticks;
+};
+
+/* Level 1 with 'obstacles' random circles; false if the level file is missing */
+bool initWorld(World &w, int obstacles);
+/* Walls, platforms and target from the file "<level>.txt" */
+bool loadLevel(World &w, int level);
+/* Wall or platform behind grid rectangle i */
+obj &levelObj(World &w, int i);
+/* Shoot the ball from the cannon towards (aimX, aimY) */
+void fire(World &w, double aimX, double aimY);
+/* Advance by dt seconds, in whole WORLD_TICKs; returns the ticks run */
+int step(World &w, double dt);
+
+#endif